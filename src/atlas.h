@@ -0,0 +1,656 @@
+#ifndef H_ATLAS
+#define H_ATLAS
+
+#include "utils.h"
+#include "thread.h"
+#include "format.h"
+
+#define ATLAS_TILE_SIZE 256
+#define ATLAS_GUTTER    2       // border of replicated edge texels around packed rects
+#define ATLAS_MIPS      3       // mip levels, rects are aligned so they don't bleed into each other at any level
+#define ATLAS_ALIGN     (1 << (ATLAS_MIPS - 1))
+#define ATLAS_MAX_SIZE  4096
+#define ATLAS_WHITE     4       // size of white texels block for colored geometry
+#define ATLAS_ALPHA_REF 153     // texels below are transparent in DXT1 (alpha test threshold of the shader)
+
+// CPU side atlas building (thread safe, no GL calls)
+namespace Atlas {
+
+// 8-bit palette index -> RGBA, index 0 is transparent
+    void initLUT(uint32 *lut, const TR::RGB *palette) {
+        for (int i = 0; i < 256; i++) {
+            TR::RGBA c = { palette[i].r, palette[i].g, palette[i].b, uint8(i ? 255 : 0) };
+            lut[i] = *(uint32*)&c;
+        }
+    }
+
+    void expand(const uint8 *src, uint32 *dst, int count, const uint32 *lut) {
+        int i = 0;
+    #if defined(__AVX2__)
+        for (; i + 16 <= count; i += 16) {
+            __m128i idx = _mm_loadu_si128((__m128i*)(src + i));
+            __m256i a = _mm256_i32gather_epi32((const int*)lut, _mm256_cvtepu8_epi32(idx), 4);
+            __m256i b = _mm256_i32gather_epi32((const int*)lut, _mm256_cvtepu8_epi32(_mm_srli_si128(idx, 8)), 4);
+            _mm256_storeu_si256((__m256i*)(dst + i), a);
+            _mm256_storeu_si256((__m256i*)(dst + i + 8), b);
+        }
+    #endif
+        for (; i < count; i++)
+            dst[i] = lut[src[i]];
+    }
+
+// tight packing of texture regions referenced by object & sprite textures
+    struct Layout {
+        struct Rect {
+            int tile, x, y, w, h;   // source region in tile (tile < 0 - white block)
+            int dx, dy;             // destination in atlas (without gutter)
+        };
+
+    // aligned size of rect with gutter
+        static int getFootprint(int size) {
+            return (size + ATLAS_GUTTER * 2 + ATLAS_ALIGN - 1) & ~(ATLAS_ALIGN - 1);
+        }
+
+        int     width, height;
+        int     rectsCount;
+        Rect    *rects;
+        int     *objectRects;   // rect index by object texture
+        bool    *objectAlpha;   // object texture region has transparent texels (alpha tested)
+        int     *spriteRects;   // rect index by sprite texture
+        int     white;          // rect index of white block
+        bool    packed;         // all rects are placed (dx, dy are valid)
+
+        const TR::Level *level;
+
+        Layout(const TR::Level &level) : width(0), height(0), rectsCount(0), level(&level) {
+            objectRects = new int[level.objectTexturesCount];
+            objectAlpha = new bool[level.objectTexturesCount];
+            spriteRects = new int[level.spriteTexturesCount];
+            rects       = new Rect[level.objectTexturesCount + level.spriteTexturesCount + 1];
+
+            white = rectsCount;
+            Rect w = { -1, 0, 0, ATLAS_WHITE, ATLAS_WHITE, 0, 0 };
+            rects[rectsCount++] = w;
+
+            for (int i = 0; i < level.objectTexturesCount; i++) {
+                const TR::ObjectTexture &t = level.objectTextures[i];
+                int x0 = 255, y0 = 255, x1 = 0, y1 = 0;
+                for (int j = 0; j < (t.tile.triangle ? 3 : 4); j++) {
+                    x0 = min(x0, (int)t.vertices[j].Xpixel);
+                    y0 = min(y0, (int)t.vertices[j].Ypixel);
+                    x1 = max(x1, (int)t.vertices[j].Xpixel);
+                    y1 = max(y1, (int)t.vertices[j].Ypixel);
+                }
+                objectRects[i] = addRect(t.tile.index, x0, y0, x1, y1);
+                objectAlpha[i] = hasAlpha(t.tile.index, x0, y0, x1, y1);
+            }
+
+            for (int i = 0; i < level.spriteTexturesCount; i++) {
+                const TR::SpriteTexture &t = level.spriteTextures[i];
+                spriteRects[i] = addRect(t.tile, t.u, t.v, min(255, t.u + (t.w >> 8)), min(255, t.v + (t.h >> 8)));
+            }
+
+            merge();
+            packed = pack();
+            if (!packed) {
+                LOG("! atlas: %d regions don't fit into %dx%d\n", rectsCount, ATLAS_MAX_SIZE, ATLAS_MAX_SIZE);
+            }
+        }
+
+        ~Layout() {
+            delete[] rects;
+            delete[] objectRects;
+            delete[] objectAlpha;
+            delete[] spriteRects;
+        }
+
+        int addRect(int tile, int x0, int y0, int x1, int y1) {
+            if (tile >= level->tilesCount || x0 > x1 || y0 > y1)
+                return white;
+            Rect r = { tile, x0, y0, x1 - x0 + 1, y1 - y0 + 1, 0, 0 };
+            rects[rectsCount] = r;
+            return rectsCount++;
+        }
+
+    // any texel with transparent (zero) palette index in the region
+        bool hasAlpha(int tile, int x0, int y0, int x1, int y1) const {
+            if (tile >= level->tilesCount || x0 > x1 || y0 > y1)
+                return false;
+            for (int y = y0; y <= y1; y++) {
+                const uint8 *row = level->tiles[tile].index + y * ATLAS_TILE_SIZE;
+                for (int x = x0; x <= x1; x++)
+                    if (!row[x]) return true;
+            }
+            return false;
+        }
+
+        static bool intersect(const Rect &a, const Rect &b) {
+            return a.tile == b.tile && a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+        }
+
+    // union overlapping regions of the same tile, texels shared by several textures are stored once
+        void merge() {
+            int *map = new int[rectsCount];
+            for (int i = 0; i < rectsCount; i++)
+                map[i] = i;
+
+            bool merged = true;
+            while (merged) {
+                merged = false;
+                for (int i = 0; i < rectsCount; i++) {
+                    if (map[i] != i) continue;
+                    for (int j = i + 1; j < rectsCount; j++) {
+                        if (map[j] != j || !intersect(rects[i], rects[j])) continue;
+                        Rect &a = rects[i], &b = rects[j];
+                        int x1 = max(a.x + a.w, b.x + b.w), y1 = max(a.y + a.h, b.y + b.h);
+                        a.x = min(a.x, b.x);
+                        a.y = min(a.y, b.y);
+                        a.w = x1 - a.x;
+                        a.h = y1 - a.y;
+                        map[j] = i;
+                        merged = true;
+                    }
+                }
+            }
+
+        // compact rects & remap texture references
+            int count = 0;
+            for (int i = 0; i < rectsCount; i++)
+                if (map[i] == i) {
+                    rects[count] = rects[i];
+                    map[i] = count++;
+                } else
+                    map[i] = map[map[i]];   // merged rects always point to lower (already remapped) index
+
+            for (int i = 0; i < level->objectTexturesCount; i++)
+                objectRects[i] = map[objectRects[i]];
+            for (int i = 0; i < level->spriteTexturesCount; i++)
+                spriteRects[i] = map[spriteRects[i]];
+            white = map[white];
+            rectsCount = count;
+
+            delete[] map;
+        }
+
+        static int cmpRects(const void *a, const void *b) {
+            const Rect &ra = **(Rect**)a, &rb = **(Rect**)b;
+            return ra.h != rb.h ? rb.h - ra.h : rb.w - ra.w;
+        }
+
+    // skyline packing of rects sorted by height, every rect goes to the lowest position of the columns height map (in ATLAS_ALIGN units)
+        bool fit(Rect **order, int w, int h) {
+            int cols = w / ATLAS_ALIGN;
+            int *skyline = new int[cols];
+            memset(skyline, 0, cols * sizeof(int));
+
+            bool result = true;
+            for (int i = 0; i < rectsCount && result; i++) {
+                Rect &r = *order[i];
+                int rw = getFootprint(r.w) / ATLAS_ALIGN, rh = getFootprint(r.h) / ATLAS_ALIGN;
+
+                int bestX = -1, bestY = h;
+                for (int x = 0; x + rw <= cols; x++) {
+                    int y = 0;
+                    for (int j = x; j < x + rw && y < bestY; j++)
+                        y = max(y, skyline[j]);
+                    if (y < bestY) {
+                        bestX = x;
+                        bestY = y;
+                    }
+                }
+
+                if (bestX < 0 || (bestY + rh) * ATLAS_ALIGN > h) {
+                    result = false;
+                    break;
+                }
+
+                for (int j = bestX; j < bestX + rw; j++)
+                    skyline[j] = bestY + rh;
+                r.dx = bestX * ATLAS_ALIGN + ATLAS_GUTTER;
+                r.dy = bestY * ATLAS_ALIGN + ATLAS_GUTTER;
+            }
+
+            delete[] skyline;
+            return result;
+        }
+
+    // find the smallest power of two atlas, returns false if rects don't fit into the max size
+        bool pack() {
+            Rect **order = new Rect*[rectsCount];
+            for (int i = 0; i < rectsCount; i++)
+                order[i] = &rects[i];
+            qsort(order, rectsCount, sizeof(order[0]), cmpRects);
+
+            bool result;
+            width = height = 64;
+            while (!(result = fit(order, width, height)) && height < ATLAS_MAX_SIZE) {
+                if (width == height)
+                    width *= 2;
+                else
+                    height *= 2;
+            }
+            delete[] order;
+            return result;
+        }
+
+        int getUsedArea() const {
+            int area = 0;
+            for (int i = 0; i < rectsCount; i++)
+                area += rects[i].w * rects[i].h;
+            return area;
+        }
+
+    // texture coordinates in units of 1/32768 of atlas size (texel centers)
+        int16 getU(int x) const { return int16(x * (32768 / width)  + (16384 / width)); }
+        int16 getV(int y) const { return int16(y * (32768 / height) + (16384 / height)); }
+
+        short2 getTexCoord(const Rect &r, int x, int y) const {
+            short2 t = { getU(r.dx + x - r.x), getV(r.dy + y - r.y) };
+            return t;
+        }
+
+    // object textures which are not in the level (dummy) refer to the white block
+        short2 getTexCoord(const TR::ObjectTexture *tex, int index) const {
+            int i = tex ? int(tex - level->objectTextures) : -1;
+            if (i < 0 || i >= level->objectTexturesCount) {
+                const Rect &r = rects[white];
+                short2 t = { getU(r.dx + 1), getV(r.dy + 1) };
+                return t;
+            }
+            return getTexCoord(rects[objectRects[i]], tex->vertices[index].Xpixel, tex->vertices[index].Ypixel);
+        }
+
+        short2 getTexCoord(const TR::SpriteTexture *tex) const {
+            return getTexCoord(rects[spriteRects[tex - level->spriteTextures]], tex->u, tex->v);
+        }
+
+        short2 getWhite() const {
+            return getTexCoord(NULL, 0);
+        }
+    };
+
+// texels count of mip levels
+    int getDataSize(int width, int height, int mips = ATLAS_MIPS) {
+        int size = 0;
+        for (int i = 0; i < mips; i++)
+            size += (width >> i) * (height >> i);
+        return size;
+    }
+
+// alpha weighted average of 2x2 texels, colors of transparent texels don't bleed into opaque ones
+    uint32 average(const uint32 *row0, const uint32 *row1) {
+        uint32 c[4] = { row0[0], row0[1], row1[0], row1[1] };
+        uint32 a = (c[0] >> 24) + (c[1] >> 24) + (c[2] >> 24) + (c[3] >> 24);
+
+        if (a == 0 || a == 4 * 255) { // equal weights, average even and odd channels in parallel
+            uint32 rb = (c[0] & 0x00FF00FF) + (c[1] & 0x00FF00FF) + (c[2] & 0x00FF00FF) + (c[3] & 0x00FF00FF) + 0x00020002;
+            uint32 g  = (c[0] & 0x0000FF00) + (c[1] & 0x0000FF00) + (c[2] & 0x0000FF00) + (c[3] & 0x0000FF00) + 0x00000200;
+            return ((rb >> 2) & 0x00FF00FF) | ((g >> 2) & 0x0000FF00) | (c[0] & 0xFF000000);
+        }
+
+        uint32 r = 0, g = 0, b = 0;
+        for (int i = 0; i < 4; i++) {
+            uint32 w = c[i] >> 24;
+            r += ( c[i]        & 0xFF) * w;
+            g += ((c[i] >> 8)  & 0xFF) * w;
+            b += ((c[i] >> 16) & 0xFF) * w;
+        }
+        return ((r + a / 2) / a) | (((g + a / 2) / a) << 8) | (((b + a / 2) / a) << 16) | (((a + 2) >> 2) << 24);
+    }
+
+    void downsample(const uint32 *src, int srcPitch, uint32 *dst, int dstPitch, int width, int height) {
+        for (int y = 0; y < height; y++) {
+            const uint32 *s = src + y * 2 * srcPitch;
+            uint32 *d = dst + y * dstPitch;
+            for (int x = 0; x < width; x++)
+                d[x] = average(s + x * 2, s + srcPitch + x * 2);
+        }
+    }
+
+    struct BuildJob {
+        const Layout    *layout;
+        TR::RGBA        *data;
+        int             mips;
+        uint32          lut[256];
+    };
+
+// every rect fills its whole aligned footprint (gutter is extended to the alignment), then downsamples it into the own footprint of each mip
+    void buildRectProc(void *arg, int index) {
+        BuildJob *job = (BuildJob*)arg;
+        const Layout::Rect &r = job->layout->rects[index];
+        int width  = job->layout->width;
+        int height = job->layout->height;
+        uint32 *data = (uint32*)job->data;
+
+        int fw = Layout::getFootprint(r.w), fh = Layout::getFootprint(r.h);
+        for (int y = -ATLAS_GUTTER; y < fh - ATLAS_GUTTER; y++) {
+            uint32 *dst = data + (r.dy + y) * width + r.dx;
+            if (r.tile < 0) {
+                for (int x = -ATLAS_GUTTER; x < fw - ATLAS_GUTTER; x++)
+                    dst[x] = 0xFFFFFFFF;
+                continue;
+            }
+            int sy = r.y + clamp(y, 0, r.h - 1);
+            expand(job->layout->level->tiles[r.tile].index + sy * ATLAS_TILE_SIZE + r.x, dst, r.w, job->lut);
+            for (int x = 1; x <= ATLAS_GUTTER; x++)
+                dst[-x] = dst[0];
+            for (int x = r.w; x < fw - ATLAS_GUTTER; x++)
+                dst[x] = dst[r.w - 1];
+        }
+
+        int fx = r.dx - ATLAS_GUTTER, fy = r.dy - ATLAS_GUTTER;
+        for (int i = 1; i < job->mips; i++) {
+            int pitch = width >> (i - 1);
+            uint32 *mip = data + pitch * (height >> (i - 1));
+            downsample(data + (fy >> (i - 1)) * pitch + (fx >> (i - 1)), pitch, mip + (fy >> i) * (pitch / 2) + (fx >> i), pitch / 2, fw >> i, fh >> i);
+            data = mip;
+        }
+    }
+
+// build packed RGBA atlas with mip levels (getDataSize texels)
+    void build(const Layout &layout, TR::RGBA *data, int threads = 0, int mips = ATLAS_MIPS) {
+        ASSERT(layout.packed);
+        BuildJob job;
+        job.layout = &layout;
+        job.data   = data;
+        job.mips   = mips;
+        initLUT(job.lut, layout.level->palette);
+        memset(data, 0, getDataSize(layout.width, layout.height, mips) * sizeof(TR::RGBA));
+        Thread::parallelFor(layout.rectsCount, buildRectProc, &job, threads);
+    }
+
+// palette index for the white block, the first one not referenced by any rect (or the brightest one)
+    uint8 getWhiteIndex(const Layout &layout) {
+        bool used[256];
+        memset(used, 0, sizeof(used));
+        used[0] = true;
+        for (int i = 0; i < layout.rectsCount; i++) {
+            const Layout::Rect &r = layout.rects[i];
+            if (r.tile < 0) continue;
+            for (int y = 0; y < r.h; y++) {
+                const uint8 *src = layout.level->tiles[r.tile].index + (r.y + y) * ATLAS_TILE_SIZE + r.x;
+                for (int x = 0; x < r.w; x++)
+                    used[src[x]] = true;
+            }
+        }
+
+        int best = 1, bestLum = -1;
+        for (int i = 1; i < 256; i++) {
+            if (!used[i]) return i;
+            const TR::RGB &c = layout.level->palette[i];
+            int lum = c.r + c.g + c.b;
+            if (lum > bestLum) {
+                bestLum = lum;
+                best = i;
+            }
+        }
+        LOG("! atlas: no free palette index for white\n");
+        return best;
+    }
+
+    struct IndexedJob {
+        const Layout    *layout;
+        uint8           *data;
+        uint8           white;
+    };
+
+    void buildIndexedRectProc(void *arg, int index) {
+        IndexedJob *job = (IndexedJob*)arg;
+        const Layout::Rect &r = job->layout->rects[index];
+        int fw = Layout::getFootprint(r.w), fh = Layout::getFootprint(r.h);
+        for (int y = -ATLAS_GUTTER; y < fh - ATLAS_GUTTER; y++) {
+            uint8 *dst = job->data + (r.dy + y) * job->layout->width + r.dx;
+            if (r.tile < 0) {
+                memset(dst - ATLAS_GUTTER, job->white, fw);
+                continue;
+            }
+            int sy = r.y + clamp(y, 0, r.h - 1);
+            memcpy(dst, job->layout->level->tiles[r.tile].index + sy * ATLAS_TILE_SIZE + r.x, r.w);
+            memset(dst - ATLAS_GUTTER, dst[0], ATLAS_GUTTER);
+            memset(dst + r.w, dst[r.w - 1], fw - ATLAS_GUTTER - r.w);
+        }
+    }
+
+// build packed 8-bit atlas of palette indices (width * height, no mips)
+    void buildIndexed(const Layout &layout, uint8 *data, uint8 white, int threads = 0) {
+        ASSERT(layout.packed);
+        IndexedJob job = { &layout, data, white };
+        memset(data, 0, layout.width * layout.height);
+        Thread::parallelFor(layout.rectsCount, buildIndexedRectProc, &job, threads);
+    }
+
+// DXT1 (BC1) encoding of the atlas with all mip levels, 8 bytes per 4x4 block
+    int getCompressedSize(int width, int height, int mips = ATLAS_MIPS) {
+        return getDataSize(width, height, mips) / 2;
+    }
+
+    uint16 pack565(const float *c) {
+        int r = clamp(int(c[0] * (31.0f / 255.0f) + 0.5f), 0, 31);
+        int g = clamp(int(c[1] * (63.0f / 255.0f) + 0.5f), 0, 63);
+        int b = clamp(int(c[2] * (31.0f / 255.0f) + 0.5f), 0, 31);
+        return uint16((r << 11) | (g << 5) | b);
+    }
+
+    void unpack565(uint16 c, int *rgb) {
+        int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        rgb[0] = (r << 3) | (r >> 2);
+        rgb[1] = (g << 2) | (g >> 4);
+        rgb[2] = (b << 3) | (b >> 2);
+    }
+
+// palette of block colors, 3 colors + transparent black if c0 <= c1
+    void getPalette(uint16 c0, uint16 c1, int pal[4][3]) {
+        unpack565(c0, pal[0]);
+        unpack565(c1, pal[1]);
+        for (int i = 0; i < 3; i++)
+            if (c0 > c1) {
+                pal[2][i] = (pal[0][i] * 2 + pal[1][i]) / 3;
+                pal[3][i] = (pal[0][i] + pal[1][i] * 2) / 3;
+            } else {
+                pal[2][i] = (pal[0][i] + pal[1][i]) / 2;
+                pal[3][i] = 0;
+            }
+    }
+
+// nearest palette colors for opaque texels, returns squared error
+    int getIndices(const int rgb[16][3], uint32 mask, uint16 c0, uint16 c1, uint32 &indices) {
+        int pal[4][3];
+        getPalette(c0, c1, pal);
+        int colors = c0 > c1 ? 4 : 3;
+        int error = 0;
+        indices = 0;
+        for (int i = 0; i < 16; i++) {
+            if (!(mask & (1 << i))) {
+                indices |= 3 << (i * 2);
+                continue;
+            }
+            int best = 0, bestDist = 0x7FFFFFFF;
+            for (int j = 0; j < colors; j++) {
+                int dr = rgb[i][0] - pal[j][0], dg = rgb[i][1] - pal[j][1], db = rgb[i][2] - pal[j][2];
+                int dist = dr * dr + dg * dg + db * db;
+                if (dist < bestDist) {
+                    bestDist = dist;
+                    best = j;
+                }
+            }
+            indices |= best << (i * 2);
+            error += bestDist;
+        }
+        return error;
+    }
+
+// endpoints by principal axis of opaque texels + one least squares refinement
+    void encodeBlock(const uint32 *src, int pitch, uint8 *dst) {
+        int rgb[16][3];
+        uint32 mask = 0;
+        int count = 0;
+        float mean[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < 16; i++) {
+            uint32 c = src[(i / 4) * pitch + (i % 4)];
+            rgb[i][0] = c & 0xFF;
+            rgb[i][1] = (c >> 8) & 0xFF;
+            rgb[i][2] = (c >> 16) & 0xFF;
+            if ((c >> 24) < ATLAS_ALPHA_REF) continue;
+            mask |= 1 << i;
+            count++;
+            for (int j = 0; j < 3; j++)
+                mean[j] += rgb[i][j];
+        }
+
+        uint16 *block = (uint16*)dst;
+        uint32 &indices = *(uint32*)(dst + 4);
+        if (!count) {
+            block[0] = block[1] = 0;
+            indices = 0xFFFFFFFF;
+            return;
+        }
+        bool alpha = count < 16;
+
+        float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int j = 0; j < 3; j++)
+            mean[j] /= count;
+        for (int i = 0; i < 16; i++) {
+            if (!(mask & (1 << i))) continue;
+            float r = rgb[i][0] - mean[0], g = rgb[i][1] - mean[1], b = rgb[i][2] - mean[2];
+            cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+            cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+        }
+
+        float axis[3] = { 1.0f, 1.0f, 1.0f };
+        for (int k = 0; k < 4; k++) {
+            float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+            float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+            float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+            float m = max(fabsf(x), max(fabsf(y), fabsf(z)));
+            if (m < EPS) break;
+            axis[0] = x / m; axis[1] = y / m; axis[2] = z / m;
+        }
+
+        float tMin = FLT_MAX, tMax = -FLT_MAX;
+        for (int i = 0; i < 16; i++) {
+            if (!(mask & (1 << i))) continue;
+            float t = (rgb[i][0] - mean[0]) * axis[0] + (rgb[i][1] - mean[1]) * axis[1] + (rgb[i][2] - mean[2]) * axis[2];
+            tMin = min(tMin, t);
+            tMax = max(tMax, t);
+        }
+        float len = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+        float e0[3], e1[3];
+        for (int j = 0; j < 3; j++) {
+            e0[j] = mean[j] + axis[j] * tMax / len;
+            e1[j] = mean[j] + axis[j] * tMin / len;
+        }
+
+        uint16 c0 = pack565(e0), c1 = pack565(e1);
+        if (alpha == (c0 > c1)) swap(c0, c1);
+        int error = getIndices(rgb, mask, c0, c1, indices);
+
+    // least squares endpoints for the chosen indices
+        if (error && c0 != c1) {
+            static const float weights[2][4] = { { 1.0f, 0.0f, 0.5f, 0.0f }, { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f } };
+            const float *w = weights[c0 > c1];
+            float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+            for (int i = 0; i < 16; i++) {
+                if (!(mask & (1 << i))) continue;
+                float a = w[(indices >> (i * 2)) & 3], b = 1.0f - a;
+                aa += a * a; bb += b * b; ab += a * b;
+                for (int j = 0; j < 3; j++) {
+                    ax[j] += a * rgb[i][j];
+                    bx[j] += b * rgb[i][j];
+                }
+            }
+            float det = aa * bb - ab * ab;
+            if (fabsf(det) > EPS) {
+                for (int j = 0; j < 3; j++) {
+                    e0[j] = (ax[j] * bb - bx[j] * ab) / det;
+                    e1[j] = (bx[j] * aa - ax[j] * ab) / det;
+                }
+                uint16 n0 = pack565(e0), n1 = pack565(e1);
+                if (alpha == (n0 > n1)) swap(n0, n1);
+                uint32 nIndices;
+                if (getIndices(rgb, mask, n0, n1, nIndices) < error) {
+                    c0 = n0;
+                    c1 = n1;
+                    indices = nIndices;
+                }
+            }
+        }
+
+    // opaque block with equal endpoints can't be in 4 colors mode, index 0 is valid for both
+        if (!alpha && c0 == c1)
+            getIndices(rgb, mask, c0, c0, indices);
+
+        block[0] = c0;
+        block[1] = c1;
+    }
+
+    void decodeBlock(const uint8 *src, uint32 *dst, int pitch) {
+        const uint16 *block = (const uint16*)src;
+        uint32 indices = *(uint32*)(src + 4);
+        int pal[4][3];
+        getPalette(block[0], block[1], pal);
+        for (int i = 0; i < 16; i++) {
+            int idx = (indices >> (i * 2)) & 3;
+            uint32 a = (block[0] <= block[1] && idx == 3) ? 0 : 255;
+            dst[(i / 4) * pitch + (i % 4)] = pal[idx][0] | (pal[idx][1] << 8) | (pal[idx][2] << 16) | (a << 24);
+        }
+    }
+
+    struct CompressJob {
+        const uint32    *data;
+        uint8           *dst;
+        int             width, height, mips;
+    };
+
+// index - row of blocks in the whole mip chain
+    void compressRowProc(void *arg, int index) {
+        CompressJob *job = (CompressJob*)arg;
+        const uint32 *data = job->data;
+        uint8 *dst = job->dst;
+        for (int i = 0; i < job->mips; i++) {
+            int w = job->width >> i, h = job->height >> i;
+            if (index < h / 4) {
+                data += index * 4 * w;
+                dst  += index * (w / 4) * 8;
+                for (int x = 0; x < w; x += 4, dst += 8)
+                    encodeBlock(data + x, w, dst);
+                return;
+            }
+            index -= h / 4;
+            data  += w * h;
+            dst   += w * h / 2;
+        }
+    }
+
+    void compress(const TR::RGBA *data, int width, int height, uint8 *dst, int threads = 0, int mips = ATLAS_MIPS) {
+        CompressJob job = { (const uint32*)data, dst, width, height, mips };
+        int rows = 0;
+        for (int i = 0; i < mips; i++)
+            rows += (height >> i) / 4;
+        Thread::parallelFor(rows, compressRowProc, &job, threads);
+    }
+
+// quality of compressed level 0, PSNR of opaque texels & count of texels with changed transparency
+    float getPSNR(const TR::RGBA *data, const uint8 *compressed, int width, int height, int &alphaErrors) {
+        double error = 0.0;
+        int count = 0;
+        alphaErrors = 0;
+        for (int y = 0; y < height; y += 4)
+            for (int x = 0; x < width; x += 4, compressed += 8) {
+                uint32 block[16];
+                decodeBlock(compressed, block, 4);
+                for (int i = 0; i < 16; i++) {
+                    const uint8 *a = (const uint8*)&data[(y + i / 4) * width + x + (i % 4)];
+                    const uint8 *b = (const uint8*)&block[i];
+                    bool opaque = a[3] >= ATLAS_ALPHA_REF;
+                    if (opaque != (b[3] != 0)) alphaErrors++;
+                    if (!opaque) continue;
+                    for (int j = 0; j < 3; j++)
+                        error += (a[j] - b[j]) * (a[j] - b[j]);
+                    count += 3;
+                }
+            }
+        return error > 0.0 ? float(10.0 * log10(255.0 * 255.0 * count / error)) : 99.0f;
+    }
+}
+
+#endif
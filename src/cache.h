@@ -0,0 +1,134 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include "utils.h"
+
+#define CACHE_MAGIC     0x43424C4F  // "OLBC"
+#define CACHE_VERSION   15
+
+// baked level data (geometry, atlas etc.) keyed by hash of the level file
+struct Cache {
+    enum ChunkID {
+        MESH_INFO, MESH_INDICES, MESH_VERTICES, MESH_ROOMS, MESH_OBJECTS, MESH_MAP, MESH_SPRITES, MESH_SHADOW, MESH_ANIM_RANGES, MESH_ANIM_OFFSETS, MESH_BUFFERS, MESH_MODELS,
+        ATLAS_INFO, ATLAS_DATA,
+        PORTALS_PVS, OCCLUSION_ROOMS, OCCLUSION_TRIANGLES,
+    };
+
+    struct Header {
+        uint32  magic;
+        uint32  version;
+        uint32  hash;       // hash of the level file
+        uint32  size;       // size of chunks data
+        uint32  checksum;   // hash of chunks data
+    };
+
+    struct Chunk {
+        uint32  id;
+        uint32  size;
+    };
+
+    const char  *name;
+    uint32      hash;
+
+    void        *mapping;
+    int         mappingSize;
+    bool        valid;
+
+    FILE        *f;
+    Header      header;
+
+    Cache(const char *name, uint32 hash) : name(name), hash(hash), mapping(NULL), mappingSize(0), valid(false), f(NULL) {
+        if (!name || !hash) return;
+
+        mapping = mapFile(name, mappingSize);
+        if (!mapping) return;
+
+        Header &h = *(Header*)mapping;
+        valid = mappingSize >= (int)sizeof(Header) &&
+                h.magic   == CACHE_MAGIC    &&
+                h.version == CACHE_VERSION  &&
+                h.hash    == hash           &&
+                h.size    == mappingSize - sizeof(Header) &&
+                h.checksum == fnv32((char*)mapping + sizeof(Header), h.size);
+
+        if (!valid) {
+            LOG("! cache: %s is stale or corrupted\n", name);
+            free();
+        }
+    }
+
+    ~Cache() {
+        free();
+        if (f) fclose(f);
+    }
+
+    void free() {
+        unmapFile(mapping, mappingSize);
+        mapping = NULL;
+        mappingSize = 0;
+        valid = false;
+    }
+
+// reading
+    const void* get(ChunkID id, int size = -1) const { // get chunk data with exact size (or any size if -1)
+        if (!valid) return NULL;
+        char *ptr = (char*)mapping + sizeof(Header);
+        char *end = (char*)mapping + mappingSize;
+        while (ptr + sizeof(Chunk) <= end) {
+            Chunk &c = *(Chunk*)ptr;
+            ptr += sizeof(Chunk);
+            if (ptr + c.size > end) break;
+            if (c.id == id)
+                return (size == -1 || (int)c.size == size) ? ptr : NULL;
+            ptr += (c.size + 3) & ~3;
+        }
+        return NULL;
+    }
+
+    template <typename T>
+    const T* get(ChunkID id, int count) const {
+        return (T*)get(id, count * sizeof(T));
+    }
+
+// writing
+    bool begin() {
+        free();
+        if (!name || !hash) return false;
+        f = fopen(name, "wb");
+        if (!f) return false;
+        header.magic    = CACHE_MAGIC;
+        header.version  = CACHE_VERSION;
+        header.hash     = hash;
+        header.size     = 0;
+        header.checksum = fnv32(NULL, 0);
+        fwrite(&header, sizeof(header), 1, f);
+        return true;
+    }
+
+    void write(const void *data, int size) { // data is zero-padded to keep chunks 4-byte aligned
+        if (!size) return;
+        uint32 zero = 0;
+        int pad = ((size + 3) & ~3) - size;
+        fwrite(data, 1, size, f);
+        fwrite(&zero, 1, pad, f);
+        header.checksum = fnv32(data, size, header.checksum);
+        header.size    += size + pad;
+    }
+
+    void put(ChunkID id, const void *data, int size) {
+        if (!f) return;
+        Chunk c = { (uint32)id, (uint32)size };
+        write(&c, sizeof(c));
+        write(data, size);
+    }
+
+    void end() {
+        if (!f) return;
+        fseek(f, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, f);
+        fclose(f);
+        f = NULL;
+    }
+};
+
+#endif
@@ -720,6 +720,11 @@ struct Controller {
     void renderMesh(const mat4 &matrix, MeshBuilder *mesh, uint32 offsetIndex) {
         MeshBuilder::MeshInfo *mInfo = mesh->meshMap[offsetIndex];
         if (!mInfo) return; // invisible mesh (offsetIndex > 0 && level.meshOffsets[offsetIndex] == 0) camera target entity etc.
+
+        if (mesh->batch) {
+            mesh->batch->add(*mInfo, matrix);
+            return;
+        }
         
         Core::active.shader->setParam(uModel, matrix);
         mesh->renderMesh(mInfo);
@@ -733,12 +738,60 @@ struct Controller {
         m.translate(vec3(offset.x, 0.0f, offset.z));
         m.scale(vec3(size.x, 0.0f, size.z) * (1.0f / 1024.0f));
 
+        if (mesh->batch) {
+            mesh->batch->add(mesh->shadowBlob, m, vec4(0.0f, 0.0f, 0.0f, 0.5f), 0.0f);
+            return;
+        }
+
         Core::active.shader->setParam(uModel, m);
         Core::active.shader->setParam(uColor, vec4(0.0f, 0.0f, 0.0f, 0.5f));
         Core::active.shader->setParam(uAmbient, vec3(0.0f));
         mesh->renderShadowSpot();
     }
 
+// single draw per skinned model the meshes are from (mesh swaps), joints of other models are collapsed to a point
+    bool renderSkinned(MeshBuilder *mesh, const mat4 *palette, int count) {
+        TR::Model &model = getModel();
+
+        int skins[MESH_MAX_JOINTS];
+        for (int i = 0; i < count; i++) {
+            skins[i] = mesh->getSkin(meshes ? meshes[i] : model.mStart + i, i);
+            if (skins[i] == -1)
+                return false;
+        }
+
+        Shader *sh = Core::active.shader;
+        mesh->skinShader->bind();
+        Core::active.shader->setParam(uColor, Core::color);
+        Core::active.shader->setParam(uAmbient, Core::ambient);
+        Core::active.shader->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
+        Core::active.shader->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
+
+        mat4 hidden;
+        hidden.identity();
+        hidden.e00 = hidden.e11 = hidden.e22 = 0.0f; // zero area triangles in front of w = 0
+
+        mat4 m[MESH_MAX_JOINTS];
+        for (int i = 0; i < count; i++) {
+            int skin = skins[i];
+            if (skin < 0) continue; // already drawn
+
+            int jCount = level->models[skin].mCount;
+            for (int j = 0; j < jCount; j++)
+                if (j >= i && j < count && skins[j] == skin) {
+                    m[j] = palette[j];
+                    skins[j] = -2;
+                } else
+                    m[j] = hidden;
+
+            Core::active.shader->setParam(uJoints, m[0], jCount);
+            mesh->renderModel(skin);
+        }
+
+        sh->bind();
+        return true;
+    }
+
     virtual void render(Frustum *frustum, MeshBuilder *mesh) {
         TR::Entity &entity = getEntity();
         TR::Model  &model  = getModel();
@@ -769,6 +822,9 @@ struct Controller {
         int sIndex = 0;
         mat4 stack[20];
 
+        mat4 palette[MESH_MAX_JOINTS];
+        bool skinned = mesh->skinShader && model.mCount <= MESH_MAX_JOINTS;
+
         for (int i = 0; i < model.mCount; i++) {
 
             if (i > 0 && node) {
@@ -789,7 +845,9 @@ struct Controller {
                 q = lerpAngle(frameA->getAngle(i), frameB->getAngle(i), t);
             matrix = matrix * mat4(q, vec3(0.0f));
             
-            if (meshes)
+            if (skinned)
+                palette[i] = matrix;
+            else if (meshes)
                 renderMesh(matrix, mesh, meshes[i]);
             else
                 renderMesh(matrix, mesh, model.mStart + i);
@@ -798,6 +856,10 @@ struct Controller {
                 joints[i] = matrix;
         }
 
+        if (skinned && !renderSkinned(mesh, palette, model.mCount))
+            for (int i = 0; i < model.mCount; i++)
+                renderMesh(palette[i], mesh, meshes ? meshes[i] : model.mStart + i);
+
         if (TR::castShadow(entity.type)) {
             TR::Level::FloorInfo info;
             level->getFloorInfo(entity.room, entity.x, entity.z, info, true);
@@ -861,6 +923,10 @@ struct SpriteController : Controller {
     virtual void render(Frustum *frustum, MeshBuilder *mesh) {
         mat4 m(Core::mModel);
         m.translate(pos);
+        if (mesh->batch) {
+            mesh->batch->add(mesh->getSprite(-(getEntity().modelIndex + 1), frame), m, Core::color, 0.0f);
+            return;
+        }
         Core::active.shader->setParam(uModel, m);
         mesh->renderSprite(-(getEntity().modelIndex + 1), frame);
     }
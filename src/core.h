@@ -26,6 +26,8 @@
 #define glBindVertexArray glBindVertexArrayAPPLE
 #define glGenVertexArrays glGenVertexArraysAPPLE
 #define glDeleteVertexArrays glDeleteVertexArraysAPPLE
+#define glDrawElementsInstanced glDrawElementsInstancedARB
+#define glVertexAttribDivisor glVertexAttribDivisorARB
 #elif __EMSCRIPTEN__
     #define MOBILE 1
     #include <emscripten.h>
@@ -35,6 +37,7 @@
 #endif
 
 #include "utils.h"
+#include "thread.h"
 #include "input.h"
 #include "sound.h"
 
@@ -52,6 +55,7 @@
 // Texture
     #ifdef WIN32
     PFNGLACTIVETEXTUREPROC              glActiveTexture;
+    PFNGLCOMPRESSEDTEXIMAGE2DPROC       glCompressedTexImage2D;
     #endif
 // Shader
     PFNGLCREATEPROGRAMPROC              glCreateProgram;
@@ -83,6 +87,9 @@
     PFNGLGENVERTEXARRAYSPROC            glGenVertexArrays;
     PFNGLDELETEVERTEXARRAYSPROC         glDeleteVertexArrays;
     PFNGLBINDVERTEXARRAYPROC            glBindVertexArray;
+// Instancing
+    PFNGLDRAWELEMENTSINSTANCEDPROC      glDrawElementsInstanced;
+    PFNGLVERTEXATTRIBDIVISORPROC        glVertexAttribDivisor;
 // Profiling
     #ifdef PROFILE
         PFNGLOBJECTLABELPROC                glObjectLabel;
@@ -128,18 +135,80 @@ namespace Core {
     vec3 ambient;
     vec4 color;
 
+// cached GL state, redundant changes are skipped (-1 or NULL is unknown state)
     struct {
         Shader  *shader;
-        Texture *testures[8];
+        Texture *textures[8];
+        int     unit;
+        GLuint  VAO;
+        GLuint  iBuffer;    // element array buffer of VAO 0 (index buffer binding is a state of VAO)
+        GLuint  vBuffer;
+        int     cullMode;
+        int     blendMode;
+        int     depthTest;
+        int     depthWrite;
+        int     colorWrite;
+        GLenum  depthFunc;
+        int     scissorTest;
+        uint64  scissor;    // x, y, width & height by 16 bits
     } active;
 
     struct {
         int dips;
         int tris;
+        int states[2];      // GL state changes issued & skipped
+        int uniforms[2];    // uniform uploads issued & skipped (unchanged values)
+        int rooms;          // rooms processed by portal traversal
+        int portals;        // portals clipped by portal traversal
+        int occluded;       // static meshes & entities culled by occlusion
     } stats;
 
+    void resetStats() {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+// forget cached GL state (after direct GL calls or deletion of objects)
+    void resetState() {
+        memset(&active, 0, sizeof(active));
+        active.unit = active.cullMode = active.blendMode = active.depthTest = active.depthWrite = active.colorWrite = active.scissorTest = -1;
+        active.scissor = uint64(-1);
+        active.VAO  = active.iBuffer = active.vBuffer = active.depthFunc = GLuint(-1);
+    }
+
+// returns true if GL state should be changed to the new value
+    template <typename T>
+    bool setState(T &state, T value) {
+        if (state == value) {
+            stats.states[1]++;
+            return false;
+        }
+        state = value;
+        stats.states[0]++;
+        return true;
+    }
+
+    void setTextureUnit(int unit) {
+        if (setState(active.unit, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    void bindVAO(GLuint VAO) {
+        if (setState(active.VAO, VAO)) {
+            glBindVertexArray(VAO);
+            active.iBuffer = GLuint(-1);
+        }
+    }
+
+    void bindBuffer(GLenum target, GLuint ID) {
+        if (setState(target == GL_ELEMENT_ARRAY_BUFFER ? active.iBuffer : active.vBuffer, ID))
+            glBindBuffer(target, ID);
+    }
+
     struct {
         bool VAO;
+        bool DXT;
+        bool index32;
+        bool instancing;
     } support;
 }
 
@@ -156,6 +225,7 @@ namespace Core {
     #if defined(WIN32) || defined(LINUX)
         #ifdef WIN32
         GetProcOGL(glActiveTexture);
+        GetProcOGL(glCompressedTexImage2D);
         #endif
         GetProcOGL(glCreateProgram);
         GetProcOGL(glDeleteProgram);
@@ -186,6 +256,9 @@ namespace Core {
         GetProcOGL(glGenVertexArrays);
         GetProcOGL(glDeleteVertexArrays);
         GetProcOGL(glBindVertexArray);
+
+        GetProcOGL(glDrawElementsInstanced);
+        GetProcOGL(glVertexAttribDivisor);
         #ifdef PROFILE
             GetProcOGL(glObjectLabel);
             GetProcOGL(glPushDebugGroup);
@@ -194,14 +267,30 @@ namespace Core {
     #endif
         support.VAO = (void*)glBindVertexArray != NULL;
 
+        const char *ext = (const char*)glGetString(GL_EXTENSIONS);
+        support.DXT = ext && (strstr(ext, "_texture_compression_s3tc") || strstr(ext, "_compressed_texture_s3tc"));
+    #ifdef MOBILE
+        support.index32 = ext && strstr(ext, "_element_index_uint");
+    #else
+        support.index32 = true;
+    #endif
+    #ifdef MOBILE
+        support.instancing = ext && strstr(ext, "_instanced_arrays");
+    #else
+        support.instancing = ext && strstr(ext, "_instanced_arrays") && strstr(ext, "_draw_instanced");
+    #endif
+
         Sound::init();
 
         for (int i = 0; i < MAX_LIGHTS; i++)
             lightColor[i] = vec4(0, 0, 0, 1);
+
+        resetState();
     }
 
     void free() {
         Sound::free();
+        Thread::free();
     }
 
     void clear(const vec4 &color) {
@@ -213,7 +302,21 @@ namespace Core {
         glViewport(x, y, width, height);
     }
 
+    void setScissor(int x, int y, int width, int height) {
+        if (setState(active.scissor, uint64(uint16(x)) | (uint64(uint16(y)) << 16) | (uint64(uint16(width)) << 32) | (uint64(uint16(height)) << 48)))
+            glScissor(x, y, width, height);
+        if (setState(active.scissorTest, 1))
+            glEnable(GL_SCISSOR_TEST);
+    }
+
+    void resetScissor() {
+        if (setState(active.scissorTest, 0))
+            glDisable(GL_SCISSOR_TEST);
+    }
+
     void setCulling(CullMode mode) {
+        if (!setState(active.cullMode, int(mode))) return;
+
         switch (mode) {
             case cfNone :
                 glDisable(GL_CULL_FACE);
@@ -230,6 +333,8 @@ namespace Core {
     }
 
     void setBlending(BlendMode mode) {
+        if (!setState(active.blendMode, int(mode))) return;
+
         switch (mode) {
             case bmNone :
                 glDisable(GL_BLEND);
@@ -251,6 +356,29 @@ namespace Core {
         if (mode != bmNone)
             glEnable(GL_BLEND);
     }
+
+    void setDepthTest(bool enable) {
+        if (!setState(active.depthTest, int(enable))) return;
+        if (enable)
+            glEnable(GL_DEPTH_TEST);
+        else
+            glDisable(GL_DEPTH_TEST);
+    }
+
+    void setDepthWrite(bool enable) {
+        if (setState(active.depthWrite, int(enable)))
+            glDepthMask(enable);
+    }
+
+    void setDepthFunc(GLenum func) {
+        if (setState(active.depthFunc, func))
+            glDepthFunc(func);
+    }
+
+    void setColorWrite(bool enable) {
+        if (setState(active.colorWrite, int(enable)))
+            glColorMask(enable, enable, enable, enable);
+    }
 }
 
 #endif
@@ -4,6 +4,7 @@
 #include "core.h"
 #include "format.h"
 #include "controller.h"
+#include "occlusion.h"
 
 namespace Debug {
 
@@ -36,12 +37,11 @@ namespace Debug {
         glPointSize(32);
 
         glUseProgram(0);
-        Core::active.shader = NULL;
-        Core::active.testures[0] = NULL;
+        Core::resetState();
     }
 
     void end() {
-        //
+        Core::resetState(); // direct GL state changes
     }
 
     namespace Draw {
@@ -513,17 +513,51 @@ namespace Debug {
             }
         }
 
+        // occlusion buffer in the bottom left corner (brighter is closer)
+        void occlusion(const Occlusion &occ) {
+            static uint8 data[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+            for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i++)
+                data[i] = occ.depth[i] > 0.0f ? uint8(255 - min(255.0f, 1.0f / occ.depth[i] / 64.0f)) : 0;
+
+            glMatrixMode(GL_MODELVIEW);
+            glPushMatrix();
+            glLoadIdentity();
+
+            glMatrixMode(GL_PROJECTION);
+            glPushMatrix();
+            glLoadIdentity();
+            glOrtho(0, Core::width, 0, Core::height, 0, 1);
+
+            glDisable(GL_DEPTH_TEST);
+            glRasterPos2f(0.0f, 0.0f);
+            glPixelZoom(2.0f, 2.0f);
+            glDrawPixels(OCCLUSION_WIDTH, OCCLUSION_HEIGHT, GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
+            glPixelZoom(1.0f, 1.0f);
+            glEnable(GL_DEPTH_TEST);
+
+            glPopMatrix();
+            glMatrixMode(GL_MODELVIEW);
+            glPopMatrix();
+
+            char buf[64];
+            sprintf(buf, "occluders = %d, pixels = %d", occ.trianglesDrawn, occ.pixelsDrawn);
+            Debug::Draw::text(vec2(16, Core::height - OCCLUSION_HEIGHT * 2 - 16), vec4(1.0f), buf);
+        }
+
         void info(const TR::Level &level, const TR::Entity &entity, int state, int anim, int frame) {
             char buf[255];
-            sprintf(buf, "DIP = %d, TRI = %d, SND = %d", Core::stats.dips, Core::stats.tris, Sound::channelsCount);
+            sprintf(buf, "DIP = %d, TRI = %d, SND = %d, STATE = %d (%d skipped), UNIFORM = %d (%d skipped)", Core::stats.dips, Core::stats.tris, Sound::channelsCount,
+                    Core::stats.states[0], Core::stats.states[1], Core::stats.uniforms[0], Core::stats.uniforms[1]);
             Debug::Draw::text(vec2(16, 16), vec4(1.0f), buf);
             sprintf(buf, "pos = (%d, %d, %d), room = %d, state = %d, anim = %d, frame = %d", entity.x, entity.y, entity.z, entity.room, state, anim, frame);
             Debug::Draw::text(vec2(16, 32), vec4(1.0f), buf);
+            sprintf(buf, "ROOMS = %d, PORTALS = %d, OCCLUDED = %d", Core::stats.rooms, Core::stats.portals, Core::stats.occluded);
+            Debug::Draw::text(vec2(16, 48), vec4(1.0f), buf);
             
             TR::Level::FloorInfo info;
             level.getFloorInfo(entity.room, entity.x, entity.z, info);
             sprintf(buf, "floor = %d, roomBelow = %d, roomAbove = %d, height = %d", info.floorIndex, info.roomBelow, info.roomAbove, info.floor - info.ceiling);
-            Debug::Draw::text(vec2(16, 48), vec4(1.0f), buf);
+            Debug::Draw::text(vec2(16, 64), vec4(1.0f), buf);
         }
     }
 }
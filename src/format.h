@@ -226,9 +226,9 @@ namespace TR {
 
         struct Light {
             int32   x, y, z;
-            uint16  align;          // ! not exists in file !
             uint16  intensity;
             uint32  attenuation;
+            uint16  align;          // ! not exists in file !
         } *lights;
 
         struct Mesh {
@@ -734,177 +734,229 @@ namespace TR {
         bool    secrets[MAX_SECRETS_COUNT];
         void    *cameraController;
 
-        Level(Stream &stream, bool demo) {
+        void    *mapping;       // file mapping for zero-copy loading (fixed layout arrays point into it)
+        int     mappingSize;
+        uint32  hash;           // hash of the file data (0 - unknown)
+
+        char    *arena;         // single allocation for all level arrays (NULL in measure pass)
+        int     arenaSize, arenaPos;
+
+        Level(Stream &stream, bool demo) : mapping(stream.mapping), mappingSize(stream.size), hash(0), arena(NULL), arenaSize(0), arenaPos(0) {
+            if (stream.data)
+                hash = fnv32(stream.data, stream.size);
+
+        // measure pass: walk through the file to get arena size, then allocate it & read for real
+            int start = stream.pos;
+            load(stream, demo);
+            arenaSize = arenaPos;
+            arenaPos  = 0;
+            arena     = new char[arenaSize];
+            stream.setPos(start);
+            load(stream, demo);
+            ASSERT(arenaPos == arenaSize);
+
+            for (int i = 0; i < spriteSequencesCount; i++)
+                spriteSequences[i].sCount = -spriteSequences[i].sCount;
+
+            for (int i = 0; i < entitiesBaseCount; i++) {
+                Entity &e = entities[i];
+                e.align = 0;
+                e.controller = NULL;
+                e.modelIndex = getModelIndex(e.type);
+            }
+            for (int i = entitiesBaseCount; i < entitiesCount; i++) {
+                entities[i].type = Entity::NONE;
+                entities[i].controller = NULL;
+            }
+
+        // modify palette colors from 6-bit Amiga colorspace
+            for (int i = 0; i < 256; i++) {
+                RGB &c = palette[i];
+                c.r <<= 2;
+                c.g <<= 2;
+                c.b <<= 2;
+            }
+
+            memset(secrets, 0, MAX_SECRETS_COUNT * sizeof(secrets[0]));
+
+            stream.detach(); // take ownership of the file mapping
+        }
+
+        ~Level() {
+            delete[] arena;
+            unmapFile(mapping, mappingSize);
+        }
+
+    // arrays are placed in the arena in file order, so all data of a room sits together
+        void load(Stream &stream, bool demo) {
+            Room dummy;
         // read version
             stream.read(version);
         // tiles
-            stream.read(tiles, stream.read(tilesCount));
+            read(stream, tiles, stream.read(tilesCount));
             stream.read(unused);
         // rooms
-            rooms = new Room[stream.read(roomsCount)];
+            stream.read(roomsCount);
+            if (roomsCount > (stream.size - stream.pos) / (int)sizeof(Room::Info)) {
+                LOG("! level: %d rooms are out of bounds\n", roomsCount);
+                roomsCount = 0;
+            }
+            rooms = alloc<Room>(roomsCount);
             for (int i = 0; i < roomsCount; i++) {
-                Room &r = rooms[i];
+                Room &r = arena ? rooms[i] : dummy;
                 Room::Data &d = r.data;
             // room info
                 stream.read(r.info);
             // room data
                 stream.read(d.size);
                 int pos = stream.pos;
-                stream.read(d.vertices,     stream.read(d.vCount));
-                stream.read(d.rectangles,   stream.read(d.rCount));
-                stream.read(d.triangles,    stream.read(d.tCount));
-                stream.read(d.sprites,      stream.read(d.sCount));
+                read(stream, d.vertices,    stream.read(d.vCount));
+                read(stream, d.rectangles,  stream.read(d.rCount));
+                read(stream, d.triangles,   stream.read(d.tCount));
+                read(stream, d.sprites,     stream.read(d.sCount));
                 stream.setPos(pos + d.size * 2);
             // portals
-                stream.read(r.portals,  stream.read(r.portalsCount));
+                read(stream, r.portals, stream.read(r.portalsCount));
             // sectors
                 stream.read(r.zSectors);
                 stream.read(r.xSectors);
-                stream.read(r.sectors, r.zSectors * r.xSectors);
+                int sectorsCount = r.zSectors * r.xSectors;
+                read(stream, r.sectors, sectorsCount);
+                if (!sectorsCount)
+                    r.zSectors = r.xSectors = 0;
             // ambient light luminance
                 stream.read(r.ambient);
             // lights
-                r.lights = new Room::Light[stream.read(r.lightsCount)];
-                for (int i = 0; i < r.lightsCount; i++) {
-                    Room::Light &light = r.lights[i];
-                    stream.read(light.x);
-                    stream.read(light.y);
-                    stream.read(light.z);
-                    stream.read(light.intensity);
-                    stream.read(light.attenuation);
-                }
-            //    stream.read(r.lights,   stream.read(r.lightsCount));
+                readPadded(stream, r.lights, stream.read(r.lightsCount), sizeof(r.lights[0]) - sizeof(r.lights[0].align));
             // meshes
-                r.meshes = new Room::Mesh[stream.read(r.meshesCount)];
-                for (int i = 0; i < r.meshesCount; i++)
-                    stream.raw(&r.meshes[i], sizeof(r.meshes[i]) - sizeof(r.meshes[i].flags));
+                readPadded(stream, r.meshes, stream.read(r.meshesCount), sizeof(r.meshes[0]) - sizeof(r.meshes[0].flags));
             // misc flags
                 stream.read(r.alternateRoom);
                 stream.read(r.flags);
             }
 
         // floors
-            stream.read(floors,         stream.read(floorsCount));
+            read(stream, floors,        stream.read(floorsCount));
         // meshes
-            stream.read(meshData,       stream.read(meshDataSize));
-            stream.read(meshOffsets,    stream.read(meshOffsetsCount));
+            read(stream, meshData,      stream.read(meshDataSize));
+            read(stream, meshOffsets,   stream.read(meshOffsetsCount));
         // animations
-            stream.read(anims,          stream.read(animsCount));
-            stream.read(states,         stream.read(statesCount));
-            stream.read(ranges,         stream.read(rangesCount));
-            stream.read(commands,       stream.read(commandsCount));
-            stream.read(nodesData,      stream.read(nodesDataSize));
-            stream.read(frameData,      stream.read(frameDataSize));
+            read(stream, anims,         stream.read(animsCount));
+            read(stream, states,        stream.read(statesCount));
+            read(stream, ranges,        stream.read(rangesCount));
+            read(stream, commands,      stream.read(commandsCount));
+            read(stream, nodesData,     stream.read(nodesDataSize));
+            read(stream, frameData,     stream.read(frameDataSize));
         // models
-            models = new Model[stream.read(modelsCount)];
-            for (int i = 0; i < modelsCount; i++)
-                stream.raw(&models[i], sizeof(models[i]) - sizeof(models[i].align));
-            stream.read(staticMeshes,   stream.read(staticMeshesCount));
+            readPadded(stream, models, stream.read(modelsCount), sizeof(models[0]) - sizeof(models[0].align));
+            read(stream, staticMeshes,  stream.read(staticMeshesCount));
         // textures & UV
-            stream.read(objectTextures,     stream.read(objectTexturesCount));
-            stream.read(spriteTextures,     stream.read(spriteTexturesCount));
-            stream.read(spriteSequences,    stream.read(spriteSequencesCount));
-            for (int i = 0; i < spriteSequencesCount; i++)
-                spriteSequences[i].sCount = -spriteSequences[i].sCount;
+            read(stream, objectTextures,    stream.read(objectTexturesCount));
+            read(stream, spriteTextures,    stream.read(spriteTexturesCount));
+            read(stream, spriteSequences,   stream.read(spriteSequencesCount));
 
             if (demo)
-                stream.read(palette,        256);
+                readFixed(stream, palette,  256);
 
         // cameras
-            stream.read(cameras,        stream.read(camerasCount));
+            read(stream, cameras,       stream.read(camerasCount));
         // sound sources
-            stream.read(soundSources,   stream.read(soundSourcesCount));
+            read(stream, soundSources,  stream.read(soundSourcesCount));
         // AI
-            stream.read(boxes,          stream.read(boxesCount));
-            stream.read(overlaps,       stream.read(overlapsCount));
-            stream.read(zones,          boxesCount);
+            read(stream, boxes,         stream.read(boxesCount));
+            read(stream, overlaps,      stream.read(overlapsCount));
+            read(stream, zones,         boxesCount);
         // animated textures
-            stream.read(animTexturesData,   stream.read(animTexturesDataSize));
+            read(stream, animTexturesData,  stream.read(animTexturesDataSize));
         // entities (enemies, items, lara etc.)
             entitiesCount = stream.read(entitiesBaseCount) + MAX_RESERVED_ENTITIES;
-            entities = new Entity[entitiesCount];
-            for (int i = 0; i < entitiesBaseCount; i++) {
-                Entity &e = entities[i];
-                stream.raw(&e, sizeof(e) - sizeof(e.align) - sizeof(e.controller) - sizeof(e.modelIndex));
-                e.align = 0;
-                e.controller = NULL;
-                e.modelIndex = getModelIndex(e.type);
-            }
-            for (int i = entitiesBaseCount; i < entitiesCount; i++) {
-                entities[i].type = Entity::NONE;
-                entities[i].controller = NULL;
-            }
+            readPadded(stream, entities, entitiesBaseCount, sizeof(entities[0]) - sizeof(entities[0].align) - sizeof(entities[0].controller) - sizeof(entities[0].modelIndex), entitiesCount);
         // palette
             stream.seek(32 * 256);  // skip lightmap palette
 
             if (!demo)
-                stream.read(palette,        256);
+                readFixed(stream, palette,  256);
 
         // cinematic frames for cameras
-            stream.read(cameraFrames,   stream.read(cameraFramesCount));
+            read(stream, cameraFrames,  stream.read(cameraFramesCount));
         // demo data
-            stream.read(demoData,       stream.read(demoDataSize));
+            read(stream, demoData,      stream.read(demoDataSize));
         // sounds
-            stream.read(soundsMap,      256);
-            stream.read(soundsInfo,     stream.read(soundsInfoCount));
-            stream.read(soundData,      stream.read(soundDataSize));
-            stream.read(soundOffsets,   stream.read(soundOffsetsCount));
+            readFixed(stream, soundsMap, 256);
+            read(stream, soundsInfo,    stream.read(soundsInfoCount));
+            read(stream, soundData,     stream.read(soundDataSize));
+            read(stream, soundOffsets,  stream.read(soundOffsetsCount));
+        }
 
-        // modify palette colors from 6-bit Amiga colorspace
-            int m = 0;
-            for (int i = 0; i < 256; i++) {
-                RGB &c = palette[i];
-                c.r <<= 2;
-                c.g <<= 2;
-                c.b <<= 2;
-            }
+        bool inBounds(const Stream &stream, int count, int stride) const {
+            if (count >= 0 && count <= (stream.size - stream.pos) / stride)
+                return true;
+            LOG("! level: array of %d items is out of bounds\n", count);
+            return false;
+        }
 
-            memset(secrets, 0, MAX_SECRETS_COUNT * sizeof(secrets[0]));
+        template <typename T>
+        T* alloc(int count) {
+            T *a = (arena && count) ? (T*)(arena + arenaPos) : NULL;
+            arenaPos += (count * sizeof(T) + 7) & ~7;
+            return a;
         }
 
-        ~Level() {
-            delete[] tiles;
-        // rooms
-            for (int i = 0; i < roomsCount; i++) {
-                Room &r = rooms[i];
-                delete[] r.data.vertices;
-                delete[] r.data.rectangles;
-                delete[] r.data.triangles;
-                delete[] r.data.sprites;
-                delete[] r.portals;
-                delete[] r.sectors;
-                delete[] r.lights;
-                delete[] r.meshes;
+    // read array of structures into the arena (or point into the file mapping if it is aligned for T)
+    // out of bounds count is reset to zero
+        template <typename T, typename C>
+        T* read(Stream &stream, T *&a, C &count) {
+            if (stream.mapping && stream.isAligned<T>())
+                return stream.read(a, count);
+
+            if (!inBounds(stream, count, sizeof(T)))
+                count = 0;
+
+            a = alloc<T>(count);
+            if (a)
+                stream.raw(a, count * sizeof(T));
+            else
+                stream.seek(count * sizeof(T));
+            return a;
+        }
+
+    // read array of fixed size into the arena, missing data at the end of file is zero filled
+        template <typename T>
+        T* readFixed(Stream &stream, T *&a, int count) {
+            a = alloc<T>(count);
+            if (a)
+                stream.raw(a, count * sizeof(T));
+            else
+                stream.seek(count * sizeof(T));
+            return a;
+        }
+
+    // read array of structures with additional (not exists in file) fields at the end
+        template <typename T, typename C>
+        T* readPadded(Stream &stream, T *&a, C &count, int stride, int capacity = 0) {
+            if (!inBounds(stream, count, stride))
+                count = 0;
+
+            capacity = max(int(count), capacity);
+            a = alloc<T>(capacity);
+            if (!a) {
+                stream.seek(count * stride);
+                return a;
             }
-            delete[] rooms;
-            delete[] floors;
-            delete[] meshData;
-            delete[] meshOffsets;
-            delete[] anims;
-            delete[] states;
-            delete[] ranges;
-            delete[] commands;
-            delete[] nodesData;
-            delete[] frameData;
-            delete[] models;
-            delete[] staticMeshes;
-            delete[] objectTextures;
-            delete[] spriteTextures;
-            delete[] spriteSequences;
-            delete[] cameras;
-            delete[] soundSources;
-            delete[] boxes;
-            delete[] overlaps;
-            delete[] zones;
-            delete[] animTexturesData;
-            delete[] entities;
-            delete[] palette;
-            delete[] cameraFrames;
-            delete[] demoData;
-            delete[] soundsMap;
-            delete[] soundsInfo;
-            delete[] soundData;
-            delete[] soundOffsets;
+            memset((void*)a, 0, capacity * sizeof(T)); // plain data, zero is the default state of extra fields
+
+            const char *src;
+            if (stream.mapping) {
+                src = stream.data + stream.pos;
+                stream.seek(count * stride);
+            } else {
+                stream.raw(a, count * stride);  // read packed items & spread them in place from the end
+                src = (char*)a;
+            }
+
+            for (int i = count - 1; i >= 0; i--)
+                memmove(&a[i], src + i * stride, stride);
+            return a;
         }
 
     // common methods
@@ -20,17 +20,18 @@ struct Frustum {
     Poly debugPoly;
 #endif
 
-    void calcPlanes(const mat4 &m) {
+// frustum of the screen rect (in NDC)
+    void calcPlanes(const mat4 &m, float x0 = -1.0f, float y0 = -1.0f, float x1 = 1.0f, float y1 = 1.0f) {
     #ifdef _DEBUG
         dbg = 0;
     #endif
         start = 0;
         count = 5;
         planes[0] = vec4(m.e30 - m.e20, m.e31 - m.e21, m.e32 - m.e22, m.e33 - m.e23); // near
-        planes[1] = vec4(m.e30 - m.e10, m.e31 - m.e11, m.e32 - m.e12, m.e33 - m.e13); // top
-        planes[2] = vec4(m.e30 - m.e00, m.e31 - m.e01, m.e32 - m.e02, m.e33 - m.e03); // right
-        planes[3] = vec4(m.e30 + m.e10, m.e31 + m.e11, m.e32 + m.e12, m.e33 + m.e13); // bottom
-        planes[4] = vec4(m.e30 + m.e00, m.e31 + m.e01, m.e32 + m.e02, m.e33 + m.e03); // left
+        planes[1] = vec4(m.e30 * y1 - m.e10, m.e31 * y1 - m.e11, m.e32 * y1 - m.e12, m.e33 * y1 - m.e13); // top
+        planes[2] = vec4(m.e30 * x1 - m.e00, m.e31 * x1 - m.e01, m.e32 * x1 - m.e02, m.e33 * x1 - m.e03); // right
+        planes[3] = vec4(m.e10 - m.e30 * y0, m.e11 - m.e31 * y0, m.e12 - m.e32 * y0, m.e13 - m.e33 * y0); // bottom
+        planes[4] = vec4(m.e00 - m.e30 * x0, m.e01 - m.e31 * x0, m.e02 - m.e32 * x0, m.e03 - m.e33 * x0); // left
         for (int i = 0; i < count; i++)
             planes[i] *= 1.0f / planes[i].xyz.length();
     }
@@ -7,15 +7,93 @@
 #include "format.h"
 #include "level.h"
 
+#define LOAD_UPLOAD_BUDGET  4.0 // max time (ms) per frame for GPU uploads of a loading level
+
 namespace Game {
     Level *level;
 
+    struct Loader {
+        const char      *name;
+        const char      *cacheName;
+        bool            demo;
+        Level           *level;     // valid when done
+        Thread::Worker  *worker;
+        volatile int    progress;   // completed loading stages
+        volatile int    done;
+        double          startTime, loadTime;
+        int             frames;
+    } *loader;
+
+    void loaderProc(void *arg) {
+        Loader *l = (Loader*)arg;
+        Stream stream(l->name, true);
+        l->level = new Level(stream, l->demo, l->cacheName, &l->progress);
+        Thread::atomicAdd(l->done, 1);
+    }
+
+    // start loading in background, current level is updated & rendered until the new one is ready
+    void load(const char *name, bool demo, const char *cacheName = NULL) {
+        if (loader) return;
+        loader = new Loader();
+        loader->name      = name;
+        loader->cacheName = cacheName;
+        loader->demo      = demo;
+        loader->startTime = Thread::getTime();
+        loader->worker    = Thread::create(loaderProc, loader);
+    }
+
+    float getProgress() {
+        if (!loader) return 1.0f;
+        int stage = Thread::atomicGet(loader->done) ? Level::lsMAX + loader->level->uploadStage : Thread::atomicGet(loader->progress);
+        return (float)stage / (Level::lsMAX + Level::usMAX);
+    }
+
+    void updateLoader() {
+        if (!loader || !Thread::atomicGet(loader->done)) return;
+
+        if (loader->worker) {
+            Thread::join(loader->worker);
+            loader->worker   = NULL;
+            loader->loadTime = Thread::getTime() - loader->startTime;
+        }
+
+        if (!loader->level->valid) {
+            LOG("! level: %s failed to load\n", loader->name);
+            delete loader->level;
+            delete loader;
+            loader = NULL;
+            return;
+        }
+
+        double time = Thread::getTime();
+        loader->frames++;
+        do {
+            if (loader->level->upload()) {
+                LOG("level: %s loaded in %.1f ms (worker %.1f ms, upload %d frames)\n", loader->name, Thread::getTime() - loader->startTime, loader->loadTime, loader->frames);
+                delete level;
+                level = loader->level;
+                delete loader;
+                loader = NULL;
+                return;
+            }
+        } while (Thread::getTime() - time < LOAD_UPLOAD_BUDGET);
+    }
+
+    void renderProgress(float progress) {
+        int w = Core::width / 2, h = max(4, Core::height / 64);
+        int x = (Core::width - w) / 2, y = Core::height / 8;
+        Core::setScissor(x, y, w, h);
+        Core::clear(vec4(0.2f, 0.2f, 0.2f, 1.0f));
+        Core::setScissor(x, y, int(w * progress), h);
+        Core::clear(vec4(1.0f));
+        Core::resetScissor();
+    }
+
     void init() {
         Core::init();
-        Stream stream("LEVEL2_DEMO.PHD");
-        level = new Level(stream, true);
+        load("LEVEL2_DEMO.PHD", true, "LEVEL2_DEMO.PHD.cache");
 
-        #ifndef __EMSCRIPTEN__    
+        #ifndef __EMSCRIPTEN__
             //Sound::play(Sound::openWAD("05_Lara's_Themes.wav"), 1, 1, 0);
             Sound::play(new Stream("05.ogg"), vec3(0.0f), 1, 1, Sound::Flags::LOOP);
             //Sound::play(new Stream("03.mp3"), 1, 1, 0);
@@ -23,20 +101,30 @@ namespace Game {
     }
 
     void free() {
+        if (loader) {
+            Thread::join(loader->worker);
+            delete loader->level;
+            delete loader;
+        }
         delete level;
 
         Core::free();
     }
 
     void update() {
-        level->update();
+        if (level)
+            level->update();
     }
 
     void render() {
+        updateLoader();
         Core::clear(vec4(0.0f));
         Core::setViewport(0, 0, Core::width, Core::height);
         Core::setBlending(bmAlpha);
-        level->render();
+        if (level)
+            level->render();
+        if (loader)
+            renderProgress(getProgress());
     }
 }
 
@@ -8,38 +8,142 @@
 #include "enemy.h"
 #include "camera.h"
 #include "trigger.h"
+#include "atlas.h"
+#include "portals.h"
+#include "occlusion.h"
 
 #ifdef _DEBUG
     #include "debug.h"
 #endif
 
+//#define ATLAS_PALETTE // 8-bit atlas + palette texture lookup in the shader (1/4 of RGBA memory, point sampled, no mips)
+//#define DEPTH_PREPASS // depth only pass of opaque room geometry before the color pass (less overdraw of expensive fragments)
+//#define OCCLUSION_CULLING // static meshes & entities hidden by room walls are culled with CPU depth buffer (off: ~0.2 ms per frame saves 0-2 of 42-51 draws in LEVEL2)
+
 const char SHADER[] =
     #include "shader.glsl"
 ;
 
 struct Level {
-    enum { shStatic, shCaustics, shSprite, shMAX };
+    enum { shStatic, shCaustics, shSprite, shInstanced, shSkinned = shInstanced * 2, shOpaque = shSkinned + shSprite, shDepth = shOpaque + shSprite, shMAX }; // + instanced, skinned & opaque (no sprite) variants, depth pre-pass
+
+    // loading stages (any thread) and GPU upload stages (render thread only)
+    enum { lsParse, lsGeometry, lsAtlas, lsCache, lsControllers, lsMAX };
+    // render queue layers: opaque faces (no alpha test), alpha tested faces, sprites
+    enum { rlOpaque, rlAlphaTest, rlSprite, rlMAX };
+    enum { usGeometry, usAtlas, usShader, usMAX = usShader + shMAX };
 
     TR::Level   level;
     Shader      *shaders[shMAX];
     Texture     *atlas;
+    Texture     *palette;       // for 8-bit atlas only
     MeshBuilder *mesh;
+    MeshBatch   *batch;         // instancing of entities (NULL if not supported)
+    RenderQueue queue;          // visible rooms & static meshes of the frame
+    Portals     *portals;       // visible rooms traversal
+    Occlusion   *occlusion;     // CPU depth buffer of visible rooms
 
     Lara        *lara;
     Camera      *camera;
 
     float       time;
 
-    Level(Stream &stream, bool demo) : level{stream, demo}, time(0.0f), lara(NULL) {
-        #ifdef _DEBUG
-            Debug::init();
-        #endif
-        mesh = new MeshBuilder(level);
-        
-        initAtlas();
-        initShaders();
+    Cache       *cache;         // baked data stays mapped until upload is done
+    uint8       *atlasData;     // all mip levels in atlasFormat
+    int         atlasWidth, atlasHeight, atlasFormat;
+    int         atlasWhite;     // palette index of white block (8-bit atlas)
+    bool        atlasBaked;
+    int         uploadStage;
+    int         uploadBand;
+    bool        valid;          // false if loading is aborted (level can't be uploaded)
+
+    Level(Stream &stream, bool demo, const char *cacheName = NULL, volatile int *progress = NULL) : level{stream, demo}, atlas(NULL), palette(NULL), batch(NULL), lara(NULL), camera(NULL), time(0.0f), atlasData(NULL), atlasFormat(tfRGBA), atlasWhite(0), atlasBaked(false), uploadStage(0), uploadBand(0), valid(true) {
+        for (int i = 0; i < shMAX; i++)
+            shaders[i] = NULL;
+        stageDone(progress);
+
+        cache   = new Cache(cacheName, level.hash);
+        mesh    = new MeshBuilder(level);
+        portals   = new Portals(level);
+    #ifdef OCCLUSION_CULLING
+        occlusion = new Occlusion(level);
+    #else
+        occlusion = NULL;
+    #endif
+
+        if (mesh->load(*cache) && portals->load(*cache) && (!occlusion || occlusion->load(*cache)) && loadAtlas(*cache)) {
+            stageDone(progress);
+            stageDone(progress);
+        } else {
+            if (cache->valid) {
+                LOG("! cache: %s is incomplete\n", cacheName);
+                cache->free();
+                delete mesh;
+                mesh = new MeshBuilder(level);
+            }
+
+            Atlas::Layout layout(level);
+            if (!layout.packed) {
+                LOG("! level: textures don't fit into the atlas, loading is aborted\n");
+                valid = false;
+                return;
+            }
+            mesh->build(layout);
+            portals->buildPVS();
+            if (occlusion)
+                occlusion->build(layout);
+            stageDone(progress);
+            buildAtlas(layout);
+            stageDone(progress);
+
+            if (cache->begin()) {
+                int info[5] = { atlasWidth, atlasHeight, getAtlasMips(atlasFormat), atlasFormat, atlasWhite };
+                mesh->save(*cache);
+                cache->put(Cache::ATLAS_INFO, info, sizeof(info));
+                cache->put(Cache::ATLAS_DATA, atlasData, getAtlasSize(atlasWidth, atlasHeight, atlasFormat));
+                portals->save(*cache);
+                if (occlusion)
+                    occlusion->save(*cache);
+                cache->end();
+            }
+        }
+        stageDone(progress);
+
         initOverrides();
+        initControllers();
+        stageDone(progress);
+    }
+
+    void stageDone(volatile int *progress) {
+        if (progress) Thread::atomicAdd(*progress, 1);
+    }
+
+// upload next GPU resource, returns true when the level is ready to render
+    bool upload() {
+        switch (uploadStage) {
+            case usGeometry :
+                #ifdef _DEBUG
+                    Debug::init();
+                #endif
+                mesh->upload();
+                break;
+            case usAtlas :
+                if (!uploadAtlas())
+                    return false;
+                if (!atlasBaked) delete[] atlasData;
+                atlasData = NULL;
+                delete cache;
+                cache = NULL;
+                break;
+            default :
+                if (uploadStage >= usMAX)
+                    return true;
+                initShader(uploadStage - usShader);
+        }
+        return ++uploadStage == usMAX;
+    }
 
+    void initControllers() {
         for (int i = 0; i < level.entitiesBaseCount; i++) {
             TR::Entity &entity = level.entities[i];
             switch (entity.type) {
@@ -120,7 +224,8 @@ struct Level {
 
     ~Level() {
         #ifdef _DEBUG
-            Debug::free();
+            if (uploadStage > usGeometry)
+                Debug::free();
         #endif
         for (int i = 0; i < level.entitiesCount; i++)
             delete (Controller*)level.entities[i].controller;
@@ -129,55 +234,180 @@ struct Level {
             delete shaders[i];
 
         delete atlas;
+        delete palette;
         delete mesh;
+        delete batch;
+        delete portals;
+        delete occlusion;
+        if (!atlasBaked) delete[] atlasData;
+        delete cache;
 
         delete camera;        
     }
 
-    void initAtlas() {
-        if (!level.tilesCount) {
-            atlas = NULL;
+    int getAtlasFormat() {
+    #ifdef ATLAS_PALETTE
+        return tfR8;
+    #else
+        return Core::support.DXT ? tfDXT1 : tfRGBA;
+    #endif
+    }
+
+    int getAtlasMips(int format) {
+    #ifdef MOBILE
+        return 1; // GLES2/WebGL1 has no GL_TEXTURE_MAX_LEVEL, partial mip chain makes the texture incomplete
+    #else
+        return format == tfR8 ? 1 : ATLAS_MIPS;
+    #endif
+    }
+
+    int getAtlasSize(int width, int height, int format) {
+        switch (format) {
+            case tfDXT1 : return Atlas::getCompressedSize(width, height, getAtlasMips(tfDXT1));
+            case tfR8   : return width * height;
+            default     : return Atlas::getDataSize(width, height, getAtlasMips(tfRGBA)) * sizeof(TR::RGBA);
+        }
+    }
+
+    bool loadAtlas(const Cache &cache) {
+        const int *info = cache.get<int>(Cache::ATLAS_INFO, 5);
+        if (!info || info[0] <= 0 || info[1] <= 0 || info[0] > ATLAS_MAX_SIZE || info[1] > ATLAS_MAX_SIZE || info[3] != getAtlasFormat() || info[2] != getAtlasMips(info[3]))
+            return false;
+        atlasData = (uint8*)cache.get(Cache::ATLAS_DATA, getAtlasSize(info[0], info[1], info[3]));
+        if (!atlasData)
+            return false;
+        atlasWidth  = info[0];
+        atlasHeight = info[1];
+        atlasFormat = info[3];
+        atlasWhite  = info[4];
+        atlasBaked  = true;
+        return true;
+    }
+
+    void buildAtlas(const Atlas::Layout &layout) {
+        atlasWidth  = layout.width;
+        atlasHeight = layout.height;
+        atlasBaked  = false;
+
+        LOG("atlas: %dx%d, %d regions, packing ratio %.1f%% (%.1f%% of 1024x1024)\n", atlasWidth, atlasHeight, layout.rectsCount,
+            layout.getUsedArea() * 100.0f / (atlasWidth * atlasHeight), atlasWidth * atlasHeight * 100.0f / (1024 * 1024));
+
+        if (getAtlasFormat() == tfR8) {
+            atlasFormat = tfR8;
+            atlasWhite  = Atlas::getWhiteIndex(layout);
+            atlasData   = new uint8[getAtlasSize(atlasWidth, atlasHeight, tfR8)];
+            Atlas::buildIndexed(layout, atlasData, atlasWhite);
             return;
         }
 
-        TR::RGBA *data = new TR::RGBA[1024 * 1024];
-        for (int i = 0; i < level.tilesCount; i++) {
-            int tx = (i % 4) * 256;
-            int ty = (i / 4) * 256;
-
-            TR::RGBA *ptr = &data[ty * 1024 + tx];
-            for (int y = 0; y < 256; y++) {
-                for (int x = 0; x < 256; x++) {
-                    int index = level.tiles[i].index[y * 256 + x];
-                    auto p = level.palette[index];
-                    ptr[x].r = p.r;
-                    ptr[x].g = p.g;
-                    ptr[x].b = p.b;
-                    ptr[x].a = index == 0 ? 0 : 255;
-                }
-                ptr += 1024;
+        atlasFormat = tfRGBA;
+        atlasData   = new uint8[getAtlasSize(atlasWidth, atlasHeight, tfRGBA)];
+        TR::RGBA *data = (TR::RGBA*)atlasData;
+        Atlas::build(layout, data, 0, getAtlasMips(tfRGBA));
+
+        if (getAtlasFormat() == tfDXT1) {
+            double time = Thread::getTime();
+            atlasFormat = tfDXT1;
+            atlasData   = new uint8[getAtlasSize(atlasWidth, atlasHeight, tfDXT1)];
+            Atlas::compress(data, atlasWidth, atlasHeight, atlasData, 0, getAtlasMips(tfDXT1));
+            time = Thread::getTime() - time;
+        #if defined(_DEBUG) || defined(PROFILE)
+            int alphaErrors;
+            float psnr = Atlas::getPSNR(data, atlasData, atlasWidth, atlasHeight, alphaErrors);
+            LOG("atlas: DXT1 %d KB in %.1f ms, PSNR %.2f dB, %d texels changed transparency\n", getAtlasSize(atlasWidth, atlasHeight, tfDXT1) / 1024, time, psnr, alphaErrors);
+        #endif
+            delete[] (uint8*)data;
+        }
+    }
+
+// upload a band of rows of some mip level per call (compressed atlas at once), returns true when the atlas is complete
+    bool uploadAtlas() {
+        int mips = getAtlasMips(atlasFormat);
+
+        if (atlasFormat == tfDXT1) {
+            atlas = new Texture(atlasWidth, atlasHeight, atlasFormat, atlasData, mips);
+            PROFILE_LABEL(TEXTURE, atlas->ID, "atlas");
+            return true;
+        }
+
+        if (!atlas) {
+            atlas = new Texture(atlasWidth, atlasHeight, atlasFormat, NULL, mips, atlasFormat != tfR8);
+            PROFILE_LABEL(TEXTURE, atlas->ID, "atlas");
+            if (atlasFormat == tfR8) {
+                uint32 lut[256];
+                Atlas::initLUT(lut, level.palette);
+                lut[atlasWhite] = 0xFFFFFFFF;
+                palette = new Texture(256, 1, tfRGBA, lut, 1, false);
+                PROFILE_LABEL(TEXTURE, palette->ID, "palette");
             }
         }
 
-        for (int y = 1020; y < 1024; y++)
-            for (int x = 1020; x < 1024; x++) {
-                int i = y * 1024 + x;
-                data[i].r = data[i].g = data[i].b = data[i].a = 255;    // white texel for colored triangles
+        int band = uploadBand++;
+        int bpp  = atlasFormat == tfR8 ? 1 : sizeof(TR::RGBA);
+        uint8 *data = atlasData;
+        for (int i = 0; i < mips; i++) {
+            int w = atlasWidth >> i, h = atlasHeight >> i;
+            int bands = (h + ATLAS_TILE_SIZE - 1) / ATLAS_TILE_SIZE;
+            if (band < bands) {
+                int y = band * ATLAS_TILE_SIZE;
+                atlas->update(0, y, w, min(ATLAS_TILE_SIZE, h - y), data + y * w * bpp, i);
+                return i == mips - 1 && band == bands - 1;
             }
+            band -= bands;
+            data += w * h * bpp;
+        }
+        return true;
+    }
 
-        atlas = new Texture(1024, 1024, 0, data);
-        delete[] data;
-        PROFILE_LABEL(TEXTURE, atlas->ID, "atlas");
+    void initShader(int index) {
+        static const char *type[shInstanced] = { "", "#define CAUSTICS\n", "#define SPRITE\n" };
+        const char *variant = "";
+        int base = index;
+        if (index >= shDepth) {
+        #ifdef DEPTH_PREPASS
+            variant = "#define DEPTH\n";
+            base = index - shDepth;
+        #else
+            return;
+        #endif
+        } else if (index >= shOpaque) {
+            variant = "#define OPAQUE\n";
+            base = index - shOpaque;
+        } else if (index >= shSkinned) {
+            if (!mesh->jointsCount || !checkUniforms()) return;
+            variant = "#define SKINNED\n";
+            base = index - shSkinned;
+        } else if (index >= shInstanced) {
+            if (!Core::support.instancing) return;
+            if (!batch) batch = new MeshBatch();
+            variant = "#define INSTANCED\n";
+            base = index - shInstanced;
+        }
+    #ifdef MESH_COMPACT
+        const char *vertexFormat = "#define COMPACT\n";
+    #else
+        const char *vertexFormat = "";
+    #endif
+        char def[255];
+        sprintf(def, "#define MAX_LIGHTS %d\n#define MAX_RANGES %d\n#define MAX_OFFSETS %d\n#define MAX_JOINTS %d\n%s%s%s%s", MAX_LIGHTS, mesh->animTexRangesCount, mesh->animTexOffsetsCount, max(1, mesh->jointsCount),
+                type[base], atlasFormat == tfR8 ? "#define PALETTE\n" : "", vertexFormat, variant);
+        shaders[index] = new Shader(SHADER, def);
     }
 
-    void initShaders() {
-        char def[255], ext[255];
-        sprintf(def, "#define MAX_LIGHTS %d\n#define MAX_RANGES %d\n#define MAX_OFFSETS %d\n", MAX_LIGHTS, mesh->animTexRangesCount, mesh->animTexOffsetsCount);
-        shaders[shStatic]   = new Shader(SHADER, def);
-        sprintf(ext, "#define MAX_LIGHTS %d\n%s#define CAUSTICS\n", MAX_LIGHTS, def);
-        shaders[shCaustics] = new Shader(SHADER, ext);
-        sprintf(ext, "#define MAX_LIGHTS %d\n%s#define SPRITE\n", MAX_LIGHTS, def);
-        shaders[shSprite]   = new Shader(SHADER, ext);
+// joints palette fits vertex uniforms of skinned shader
+    bool checkUniforms() {
+        GLint count = 0;
+    #ifdef MOBILE
+        glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &count);
+    #else
+        glGetIntegerv(GL_MAX_VERTEX_UNIFORM_COMPONENTS, &count);
+        count /= 4;
+    #endif
+        int used = 4 * 3 + MAX_LIGHTS + 2 + mesh->animTexRangesCount + mesh->animTexOffsetsCount + mesh->jointsCount * 4;
+        if (used <= count)
+            return true;
+        LOG("! shader: %d of %d vertex uniforms for skinning, disabled\n", used, count);
+        return false;
     }
 
     void initOverrides() {
@@ -227,26 +457,47 @@ struct Level {
         }
     }
 
-    void renderRoom(int roomIndex, int from = -1) {
+// bind shader with current model, color & lights
+    void bindShader(Shader *sh) {
+        sh->bind();
+        sh->setParam(uModel, Core::mModel);
+        sh->setParam(uColor, Core::color);
+        sh->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
+        sh->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
+        sh->setParam(uAmbient, Core::ambient);
+    }
+
+// distance from camera to the box (sort depth of render queue)
+    float getDepth(const vec3 &min, const vec3 &max) {
+        const vec3 &p = Core::viewPos;
+        vec3 d = vec3(clamp(p.x, min.x, max.x), clamp(p.y, min.y, max.y), clamp(p.z, min.z, max.z)) - p;
+        return d.length();
+    }
+
+    void addToQueue(int layer, int shader, float depth, const MeshRange &range, const short4 &scissor, const mat4 &model) {
+        queue.add(RenderQueue::getKey(layer, shader, depth), shaders[shader], range, scissor, model, Core::color, Core::ambient.x, Core::lightPos[0], Core::lightColor[0]);
+    }
+
+// collect geometry of visible room & its static meshes into render queue (no GL calls)
+// room geometry is drawn inside the screen rect of its portals (scissor)
+    void queueRoom(int roomIndex, const Frustum &frustum, const short4 &scissor) {
         ASSERT(roomIndex >= 0 && roomIndex < level.roomsCount);
-        PROFILE_MARKER("ROOM");
 
         TR::Room &room = level.rooms[roomIndex];
         vec3 offset = vec3(room.info.x, 0.0f, room.info.z);
+        vec3 rMin   = vec3(offset.x, float(room.info.yTop), offset.z);
+        vec3 rMax   = vec3(offset.x + room.xSectors * 1024.0f, float(room.info.yBottom), offset.z + room.zSectors * 1024.0f);
+        short4 full = { 0, 0, short(Core::width), short(Core::height) };
 
-        Shader *sh = setRoomShader(room, 1.0f);
+        setRoomShader(room, 1.0f);
+        int type = room.flags.water ? shCaustics : shStatic;
 
-        sh->bind();
-        sh->setParam(uColor, Core::color);
-        sh->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
-        sh->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
-        sh->setParam(uAmbient, vec3(0.0f));//Core::ambient);
-
-    // room static meshes
+    // room static meshes (if not baked into room geometry)
         {
             for (int i = 0; i < room.meshesCount; i++) {
                 TR::Room::Mesh &rMesh = room.meshes[i];
                 if (rMesh.flags.rendered) continue;    // skip if already rendered
+                if (mesh->getBakedMesh(roomIndex, rMesh)) continue;
 
                 TR::StaticMesh *sMesh = level.getMeshByID(rMesh.meshID);
                 ASSERT(sMesh != NULL);
@@ -255,85 +506,51 @@ struct Level {
                 Box box;
                 vec3 offset = vec3(rMesh.x, rMesh.y, rMesh.z);
                 sMesh->getBox(false, rMesh.rotation, box);
-                if (!camera->frustum->isVisible(offset + box.min, offset + box.max))
+                vec3 bMin = offset + box.min, bMax = offset + box.max;
+                if (!frustum.isVisible(bMin, bMax))
                     continue;
+                if (occlusion && !occlusion->isVisible(bMin, bMax)) {
+                    Core::stats.occluded++;
+                    continue;
+                }
                 rMesh.flags.rendered = true;
 
             // set light parameters
                 getLight(offset, roomIndex);
 
-                if (rMesh.intensity >= 0) {
-                    Core::ambient = vec3(intensity(rMesh.intensity) / 255.0f);
-                    Core::ambient       = vec3(0.0);
-                    sh->setParam(uAmbient, Core::ambient);
-                }
-
-            // render static mesh
-                mat4 mTemp = Core::mModel;
-                Core::mModel.translate(offset);
-                Core::mModel.rotateY(rMesh.rotation);
-                sh->setParam(uModel, Core::mModel);
-                mesh->renderMesh(mesh->meshMap[sMesh->mesh]);
-                Core::mModel = mTemp;
+                if (rMesh.intensity >= 0)
+                    Core::ambient = vec3(0.0);
+
+            // static mesh without transparent texels has no alpha test
+                mat4 m = Core::mModel;
+                m.translate(offset);
+                m.rotateY(rMesh.rotation);
+                const MeshRange &range = *mesh->meshMap[sMesh->mesh];
+            // mesh sticking out of the room can be seen beside its portals
+                const short4 &rect = (bMin.x >= rMin.x && bMin.y >= rMin.y && bMin.z >= rMin.z && bMax.x <= rMax.x && bMax.y <= rMax.y && bMax.z <= rMax.z) ? scissor : full;
+                if (range.iOpaque == range.iCount)
+                    addToQueue(rlOpaque, shOpaque + type, getDepth(bMin, bMax), range, rect, m);
+                else
+                    addToQueue(rlAlphaTest, type, getDepth(bMin, bMax), range, rect, m);
             }
         }
 
     // room geometry & sprites
         if (!room.flags.rendered) {    // skip if already rendered
-
-            mat4 mTemp = Core::mModel;
             room.flags.rendered = true;
 
             Core::lightColor[0] = vec4(0, 0, 0, 1);
             Core::ambient       = vec3(0.0);
 
-            sh->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
-            sh->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
-            sh->setParam(uAmbient, Core::ambient);
-
-            Core::mModel.translate(offset);
-
-        // render room geometry
-            sh->setParam(uModel, Core::mModel);
-            mesh->renderRoomGeometry(roomIndex);
-
-        // render room sprites
-            if (mesh->hasRoomSprites(roomIndex)) {
-                sh = shaders[shSprite];
-                sh->bind();
-                sh->setParam(uModel, Core::mModel);
-                sh->setParam(uColor, Core::color);
-                sh->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
-                sh->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
-                sh->setParam(uAmbient, vec3(0.0f));//Core::ambient);
-                mesh->renderRoomSprites(roomIndex);
-            }
-
-            Core::mModel = mTemp;
-        }
-
-    // render rooms through portals recursively
-        Frustum *camFrustum = camera->frustum;   // push camera frustum
-        Frustum frustum;
-        camera->frustum = &frustum;
-
-        for (int i = 0; i < room.portalsCount; i++) {
-            TR::Room::Portal &p = room.portals[i];
+            mat4 m = Core::mModel;
+            m.translate(offset);
 
-            if (p.roomIndex == from) continue;
-
-            vec3 v[] = {
-                offset + p.vertices[0],
-                offset + p.vertices[1],
-                offset + p.vertices[2],
-                offset + p.vertices[3],
-            };
-
-            frustum = *camFrustum;
-            if (frustum.clipByPortal(v, 4, p.normal))
-                renderRoom(p.roomIndex, roomIndex);
+            const MeshBuilder::RoomRange &range = mesh->roomRanges[roomIndex];
+            float depth = getDepth(rMin, rMax);
+            addToQueue(rlOpaque,    shOpaque + type, depth, range.geometry.getPart(true),  scissor, m);
+            addToQueue(rlAlphaTest, type,            depth, range.geometry.getPart(false), scissor, m);
+            addToQueue(rlSprite,    shSprite,        depth, range.sprites,                 scissor, m);
         }
-        camera->frustum = camFrustum;    // pop camera frustum
     }
 
     int getLightIndex(const vec3 &pos, int &room) {
@@ -368,9 +585,6 @@ struct Level {
         }
 
         Core::ambient = vec3(1.0f - level.rooms[roomIndex].ambient / 8191.0f);
-        Core::active.shader->setParam(uAmbient, Core::ambient);
-        Core::active.shader->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
-        Core::active.shader->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
     }
 
     void renderEntity(const TR::Entity &entity) {
@@ -381,24 +595,72 @@ struct Level {
         if (!room.flags.rendered || entity.flags.invisible || entity.flags.rendered)
             return;
 
+        Controller *controller = (Controller*)entity.controller;
+        if (occlusion && entity.modelIndex > 0) { // box of any rotation of animated model
+            Box box = controller->getBoundingBox();
+            vec3 r = vec3(max(fabsf(box.min.x - controller->pos.x), fabsf(box.max.x - controller->pos.x)),
+                          max(fabsf(box.min.y - controller->pos.y), fabsf(box.max.y - controller->pos.y)),
+                          max(fabsf(box.min.z - controller->pos.z), fabsf(box.max.z - controller->pos.z)));
+            r = vec3(r.length());
+            if (!occlusion->isVisible(controller->pos - r, controller->pos + r)) {
+                Core::stats.occluded++;
+                return;
+            }
+        }
+
         float c = (entity.intensity > -1) ? (1.0f - entity.intensity / (float)0x1FFF) : 1.0f;
         float l = 1.0f;
 
-        if (entity.modelIndex > 0) { // model
-            // set shader
-            setRoomShader(room, c)->bind();
-            Core::active.shader->setParam(uColor, Core::color);
-            // get light parameters for entity
-            getLight(vec3(entity.x, entity.y, entity.z), entity.room);
-        }
+        Shader *sh = Core::active.shader;
+        if (entity.modelIndex > 0) // model
+            sh = setRoomShader(room, c);
 
         if (entity.modelIndex < 0) { // sprite
-            shaders[shSprite]->bind();
+            sh = shaders[shSprite];
             Core::color = vec4(c, c, c, 1.0f);
         }
-        Core::active.shader->setParam(uColor, Core::color);
 
-        ((Controller*)entity.controller)->render(camera->frustum, mesh);
+        int variant = entity.modelIndex < 0 ? shSprite : (sh == shaders[shCaustics] ? shCaustics : shStatic);
+        mesh->skinShader = NULL;
+        if (mesh->batch)
+            mesh->batch->variant = variant;
+        else {
+            if (entity.modelIndex > 0)
+                mesh->skinShader = shaders[shSkinned + variant];
+            sh->bind();
+            sh->setParam(uColor, Core::color);
+        }
+
+        if (entity.modelIndex > 0) { // get light parameters for entity
+            getLight(vec3(entity.x, entity.y, entity.z), entity.room);
+            if (!mesh->batch) { // or per instance
+                sh->setParam(uAmbient, Core::ambient);
+                sh->setParam(uLightPos, Core::lightPos[0], MAX_LIGHTS);
+                sh->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
+            }
+        }
+
+        controller->render(camera->frustum, mesh);
+    }
+
+// instanced draw of every group collected by renderEntities
+    void renderBatch() {
+        PROFILE_MARKER("INSTANCES");
+        if (!batch->count) return;
+
+        batch->sort();
+        mesh->mesh->setInstances(batch->sorted, batch->count);
+
+        for (int alpha = 0; alpha < 2; alpha++)
+            for (int i = 0; i < batch->groupsCount; i++) {
+                MeshBatch::Group &g = batch->groups[i];
+                if (g.alpha != (alpha == 1)) continue;
+
+                shaders[shInstanced + g.variant]->bind();
+                mesh->mesh->renderInstanced(g.range, g.first, g.count);
+            }
+
+        batch->reset();
     }
 
     void update() {
@@ -418,7 +680,9 @@ struct Level {
         PROFILE_MARKER("SETUP");
 
         camera->setup();;
-        atlas->bind(0);
+        atlas->bind(sDiffuse);
+        if (palette)
+            palette->bind(sPalette);
 
         if (!Core::support.VAO)
             mesh->bind();
@@ -426,6 +690,7 @@ struct Level {
         // set frame constants for all shaders
         Core::active.shader = NULL;
         for (int i = 0; i < shMAX; i++) {
+            if (!shaders[i]) continue;
             shaders[i]->bind();
             shaders[i]->setParam(uViewProj, Core::mViewProj);
             shaders[i]->setParam(uViewInv, Core::mViewInv);
@@ -433,8 +698,10 @@ struct Level {
             shaders[i]->setParam(uParam, vec4(time, 0, 0, 0));
             shaders[i]->setParam(uAnimTexRanges, mesh->animTexRanges[0], mesh->animTexRangesCount);
             shaders[i]->setParam(uAnimTexOffsets, mesh->animTexOffsets[0], mesh->animTexOffsetsCount);
+            if (i >= shInstanced) // lights except the first one
+                shaders[i]->setParam(uLightColor, Core::lightColor[0], MAX_LIGHTS);
         }
-        glEnable(GL_DEPTH_TEST);
+        Core::setDepthTest(true);
 
         Core::setCulling(cfFront);
 
@@ -453,17 +720,89 @@ struct Level {
             level.entities[i].flags.rendered = false;
     }
 
+// draw queue items of the layer with their shaders (or with the given one)
+    void renderQueue(int layer, Shader *shader = NULL) {
+        for (int i = 0; i < queue.count; i++) {
+            const RenderQueue::Item &item = queue[i];
+            if (RenderQueue::getLayer(item.key) != layer) continue;
+
+            Core::mModel        = item.params.model;
+            Core::color         = item.params.color;
+            Core::ambient       = vec3(item.params.lightPos.w);
+            Core::lightPos[0]   = item.params.lightPos.xyz;
+            Core::lightColor[0] = item.params.lightColor;
+            Core::setScissor(item.scissor.x, item.scissor.y, item.scissor.z, item.scissor.w);
+            bindShader(shader ? shader : item.shader);
+            mesh->mesh->render(item.range);
+        }
+    }
+
     void renderRooms() {
         PROFILE_MARKER("ROOMS");
-        renderRoom(camera->getRoomIndex());
+        queue.reset();
+        portals->traverse(camera->getRoomIndex(), Core::mViewProj, Core::viewPos);
+        Core::stats.rooms   += portals->roomsVisited;
+        Core::stats.portals += portals->portalsClipped;
+        if (occlusion)
+            occlusion->render(portals->visible, portals->visibleCount, Core::mViewProj, Core::viewPos);
+        for (int i = 0; i < portals->visibleCount; i++) {
+            Frustum frustum;
+            short4  scissor;
+            portals->getFrustum(portals->visible[i], Core::mViewProj, Core::viewPos, frustum);
+            portals->getScissor(portals->visible[i], Core::width, Core::height, scissor);
+            queueRoom(portals->visible[i], frustum, scissor);
+        }
+        queue.sort();
+
+        mat4 mTemp = Core::mModel;
+    #ifdef DEPTH_PREPASS
+        {
+            PROFILE_MARKER("DEPTH");
+            Core::setColorWrite(false);
+            renderQueue(rlOpaque, shaders[shDepth]);
+            Core::setColorWrite(true);
+        }
+        Core::setDepthFunc(GL_LEQUAL); // opaque faces pass at depth of the pre-pass
+    #endif
+        {
+            PROFILE_MARKER("OPAQUE");
+            renderQueue(rlOpaque);
+        }
+    #ifdef DEPTH_PREPASS
+        Core::setDepthFunc(GL_LESS);
+    #endif
+        {
+            PROFILE_MARKER("ALPHA_TEST");
+            renderQueue(rlAlphaTest);
+        }
+        {
+            PROFILE_MARKER("SPRITES");
+            renderQueue(rlSprite);
+        }
+        Core::resetScissor();
+        Core::mModel = mTemp;
     }
 
     void renderEntities() {
         PROFILE_MARKER("ENTITIES");
 
         shaders[shStatic]->bind();
+        if (!batch) {
+            for (int i = 0; i < level.entitiesCount; i++)
+                renderEntity(level.entities[i]);
+            return;
+        }
+
+    // Lara draws extra meshes with own shading, after the instances to keep her shadow on top of them
+        mesh->batch = batch;
         for (int i = 0; i < level.entitiesCount; i++)
-            renderEntity(level.entities[i]);
+            if (level.entities[i].controller != lara)
+                renderEntity(level.entities[i]);
+        mesh->batch = NULL;
+
+        renderBatch();
+        if (lara)
+            renderEntity(lara->getEntity());
     }
 
     void renderScene() {
@@ -482,6 +821,7 @@ struct Level {
         //    Debug::Level::portals(level);
         //    Debug::Level::meshes(level);
         //    Debug::Level::entities(level);
+        //    if (occlusion) Debug::Level::occlusion(*occlusion);
         Debug::Level::info(level, lara->getEntity(), (int)lara->state, lara->animIndex, int(lara->animTime * 30.0f));
         Debug::end();
     #endif
@@ -3,9 +3,22 @@
 
 #include "core.h"
 #include "format.h"
+#include "cache.h"
+#include "atlas.h"
+#include "optimizer.h"
 
-typedef unsigned short Index;
+//#define MESH_COMPACT // 20-byte vertices in GPU buffer & cache (octahedral normals, anim tex range & frame in coord.w)
+//#define MESH_BAKE_STATIC // static meshes inside their room are pre-transformed into room geometry with baked lighting (no per mesh draws)
 
+#define MESH_MAX_JOINTS 32 // models with more meshes are not skinned (size of joints palette uniform)
+
+#ifndef MESH_BUFFER_SIZE
+    #define MESH_BUFFER_SIZE (32 * 1024 * 1024) // max size of vertex or index buffer, larger geometry is split into few buffers
+#endif
+
+typedef unsigned short Index; // ranges of more than 64K vertices have 32-bit indices (two Index each)
+
+// vertex format of the fill pass (and GPU buffer by default)
 struct Vertex {
     short4  coord;      // xyz  - position
     short4  texCoord;   // xy   - texture coordinates, z - anim tex range index, w - anim tex frame index
@@ -13,48 +26,142 @@ struct Vertex {
     ubyte4  color;      // rgba - color
 };
 
-struct MeshRange {
-    int iStart;
+struct VertexCompact {
+    short4  coord;      // xyz  - position, w - anim tex range index * 256 + frame index
+    short2  texCoord;   // xy   - texture coordinates
+    short2  normal;     // xy   - octahedral vertex normal (sprites: corner offset)
+    ubyte4  color;      // rgba - color
+
+    static short2 encodeNormal(const short4 &n) {
+        float x = n.x, y = n.y, z = n.z;
+        float s = fabsf(x) + fabsf(y) + fabsf(z);
+        if (s == 0.0f) {
+            short2 r = { 0, 0 };
+            return r;
+        }
+        x /= s;
+        y /= s;
+        if (z < 0.0f) { // fold lower hemisphere
+            float t = x;
+            x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            y = (1.0f - fabsf(t)) * (y >= 0.0f ? 1.0f : -1.0f);
+        }
+        short2 r = { int16(roundf(x * 32767.0f)), int16(roundf(y * 32767.0f)) };
+        return r;
+    }
+
+    static VertexCompact pack(Vertex v, bool sprite) { // by value, source & destination may overlap
+        VertexCompact c;
+        c.coord    = v.coord;
+        c.texCoord = { v.texCoord.x, v.texCoord.y };
+        c.color    = v.color;
+        if (sprite) {
+            c.normal = { v.texCoord.z, v.texCoord.w };
+        } else {
+            ASSERT(v.texCoord.z < 128 && v.texCoord.w < 256);
+            c.coord.w = v.texCoord.z * 256 + v.texCoord.w;
+            c.normal  = encodeNormal(v.normal);
+        }
+        return c;
+    }
+};
+
+#ifdef MESH_COMPACT
+    typedef VertexCompact MeshVertex;
+#else
+    typedef Vertex MeshVertex;
+#endif
+
+// index & vertex buffers pair, ranges refer to it relative
+struct MeshBuffer {
+    int iStart;     // in Index units
     int iCount;
     int vStart;
-    int aIndex;
+    int vCount;
+};
 
-    MeshRange() : aIndex(-1) {}
+struct MeshRange {
+    int iStart;     // in Index units
+    int iCount;     // indices
+    int vStart;
+    int aIndex;
+    int buffer;
+    int index32;    // 32-bit indices
+    int iOpaque;    // indices of faces without transparent texels (first in range, alpha tested ones follow)
+
+    MeshRange() : aIndex(-1), buffer(0), index32(0), iOpaque(0) {}
+
+// first (opaque) or second (alpha tested) part of range
+    MeshRange getPart(bool opaque) const {
+        MeshRange r = *this;
+        if (opaque)
+            r.iCount = iOpaque;
+        else {
+            r.iStart += iOpaque * (index32 ? 2 : 1);
+            r.iCount -= iOpaque;
+        }
+        return r;
+    }
 
     void setup() const {
-        Vertex *v = (Vertex*)(vStart * sizeof(Vertex));
-        glVertexAttribPointer(aCoord,    4, GL_SHORT,         false, sizeof(Vertex), &v->coord);
-        glVertexAttribPointer(aTexCoord, 4, GL_SHORT,         false, sizeof(Vertex), &v->texCoord);
-        glVertexAttribPointer(aNormal,   4, GL_SHORT,         false, sizeof(Vertex), &v->normal);
-        glVertexAttribPointer(aColor,    4, GL_UNSIGNED_BYTE, true,  sizeof(Vertex), &v->color);
+        MeshVertex *v = (MeshVertex*)(vStart * sizeof(MeshVertex));
+    #ifdef MESH_COMPACT
+        glVertexAttribPointer(aCoord,    4, GL_SHORT,         false, sizeof(MeshVertex), &v->coord);
+        glVertexAttribPointer(aTexCoord, 2, GL_SHORT,         false, sizeof(MeshVertex), &v->texCoord);
+        glVertexAttribPointer(aNormal,   2, GL_SHORT,         false, sizeof(MeshVertex), &v->normal);
+        glVertexAttribPointer(aColor,    4, GL_UNSIGNED_BYTE, true,  sizeof(MeshVertex), &v->color);
+    #else
+        glVertexAttribPointer(aCoord,    4, GL_SHORT,         false, sizeof(MeshVertex), &v->coord);
+        glVertexAttribPointer(aTexCoord, 4, GL_SHORT,         false, sizeof(MeshVertex), &v->texCoord);
+        glVertexAttribPointer(aNormal,   4, GL_SHORT,         false, sizeof(MeshVertex), &v->normal);
+        glVertexAttribPointer(aColor,    4, GL_UNSIGNED_BYTE, true,  sizeof(MeshVertex), &v->color);
+    #endif
     }
 
     void bind(GLuint *VAO) const {
         if (aIndex > -1)
-            glBindVertexArray(VAO[aIndex]);
+            Core::bindVAO(VAO[aIndex]);
         else
             setup();        
     }
 };
 
+// per instance attributes of instanced draws
+struct MeshInstance {
+    mat4    model;
+    vec4    color;
+    vec4    lightPos;   // xyz - position of light 0, w - ambient
+    vec4    lightColor;
+};
+
 struct Mesh {
-    GLuint  ID[2];
+    GLuint  *ID;        // index & vertex buffer of every MeshBuffer
     GLuint  *VAO;
+    GLuint  instanceID; // stream of MeshInstance
     int     iCount;
     int     vCount;
     int     aCount;
     int     aIndex;
-
-    Mesh(Index *indices, int iCount, Vertex *vertices, int vCount, int aCount) : VAO(NULL), iCount(iCount), vCount(vCount), aCount(aCount), aIndex(0) {
-        glGenBuffers(2, ID);
-        bind();
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, iCount * sizeof(Index), indices, GL_STATIC_DRAW);
-        glBufferData(GL_ARRAY_BUFFER, vCount * sizeof(Vertex), vertices, GL_STATIC_DRAW);
+    int     bCount;
+    int     buffer;     // bound buffers pair
+
+    Mesh(Index *indices, int iCount, MeshVertex *vertices, int vCount, int aCount, const MeshBuffer *buffers, int bCount) : VAO(NULL), instanceID(0), iCount(iCount), vCount(vCount), aCount(aCount), aIndex(0), bCount(bCount), buffer(0) {
+        ID = new GLuint[bCount * 2];
+        glGenBuffers(bCount * 2, ID);
+        for (int i = 0; i < bCount; i++) {
+            const MeshBuffer &b = buffers[i];
+            bindBuffer(i);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, b.iCount * sizeof(Index), indices + b.iStart, GL_STATIC_DRAW);
+            glBufferData(GL_ARRAY_BUFFER, b.vCount * sizeof(MeshVertex), vertices + b.vStart, GL_STATIC_DRAW);
+        }
 
         if (Core::support.VAO && aCount) {
             VAO = new GLuint[aCount];
             glGenVertexArrays(aCount, VAO);
         }
+
+        if (Core::support.instancing)
+            glGenBuffers(1, &instanceID);
     }
 
     virtual ~Mesh() {
@@ -62,22 +169,33 @@ struct Mesh {
             glDeleteVertexArrays(aCount, VAO);
             delete[] VAO;
         }
-        glDeleteBuffers(2, ID);
+        if (instanceID)
+            glDeleteBuffers(1, &instanceID);
+        glDeleteBuffers(bCount * 2, ID);
+        delete[] ID;
+        Core::active.VAO = Core::active.iBuffer = Core::active.vBuffer = GLuint(-1); // names can be reused
     }
 
     void initRange(MeshRange &range) {
         if (Core::support.VAO) {
             range.aIndex = aIndex++;
             range.bind(VAO);
-            bind();
+            bindBuffer(range.buffer);
             range.setup();
         } else
             range.aIndex = -1;
     }
 
+// index buffer binding is a state of bound VAO
     void bind() {
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ID[0]);
-        glBindBuffer(GL_ARRAY_BUFFER, ID[1]);
+        if (VAO) Core::bindVAO(0);
+        bindBuffer(0);
+    }
+
+    void bindBuffer(int index) {
+        buffer = index;
+        Core::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ID[index * 2 + 0]);
+        Core::bindBuffer(GL_ARRAY_BUFFER, ID[index * 2 + 1]);
 
         glEnableVertexAttribArray(aCoord);
         glEnableVertexAttribArray(aTexCoord);
@@ -86,12 +204,258 @@ struct Mesh {
     }
 
     void render(const MeshRange &range) {
+        if (range.aIndex == -1 && range.buffer != buffer)
+            bindBuffer(range.buffer);
         range.bind(VAO);
-        glDrawElements(GL_TRIANGLES, range.iCount, GL_UNSIGNED_SHORT, (GLvoid*)(range.iStart * sizeof(Index)));
+        glDrawElements(GL_TRIANGLES, range.iCount, range.index32 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT, (GLvoid*)(range.iStart * sizeof(Index)));
 
         Core::stats.dips++;
         Core::stats.tris += range.iCount / 3;
     }
+
+// instance data of the frame, renderInstanced refers to it
+    void setInstances(const MeshInstance *instances, int count) {
+        Core::bindBuffer(GL_ARRAY_BUFFER, instanceID);
+        glBufferData(GL_ARRAY_BUFFER, count * sizeof(MeshInstance), instances, GL_STREAM_DRAW);
+        Core::bindBuffer(GL_ARRAY_BUFFER, ID[buffer * 2 + 1]);
+    }
+
+    void renderInstanced(const MeshRange &range, int first, int count) {
+        if (range.aIndex == -1 && range.buffer != buffer)
+            bindBuffer(range.buffer);
+        range.bind(VAO);
+
+    // instance attributes are enabled for this draw only (VAO state is shared with regular draws)
+        MeshInstance *inst = (MeshInstance*)(first * sizeof(MeshInstance));
+        const GLvoid *ptr[] = { &inst->model.right, &inst->model.up, &inst->model.dir, &inst->model.offset, &inst->color, &inst->lightPos, &inst->lightColor };
+        Core::bindBuffer(GL_ARRAY_BUFFER, instanceID);
+        for (int i = aModel0; i < aMAX; i++) {
+            glEnableVertexAttribArray(i);
+            glVertexAttribPointer(i, 4, GL_FLOAT, false, sizeof(MeshInstance), ptr[i - aModel0]);
+            glVertexAttribDivisor(i, 1);
+        }
+
+        glDrawElementsInstanced(GL_TRIANGLES, range.iCount, range.index32 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT, (GLvoid*)(range.iStart * sizeof(Index)), count);
+
+        for (int i = aModel0; i < aMAX; i++) {
+            glVertexAttribDivisor(i, 0);
+            glDisableVertexAttribArray(i);
+        }
+        Core::bindBuffer(GL_ARRAY_BUFFER, ID[buffer * 2 + 1]);
+
+        Core::stats.dips++;
+        Core::stats.tris += range.iCount / 3 * count;
+    }
+};
+
+// instances of equal ranges collected per frame (entity models & sprites), instanced draw per group
+struct MeshBatch {
+    struct Group {
+        MeshRange range;
+        int       variant;  // base shader of the instances (shStatic, shCaustics or shSprite of Level)
+        bool      alpha;    // translucent, drawn after opaque groups
+        int       first;
+        int       count;
+    } *groups;
+    int groupsCount, groupsMax;
+
+    MeshInstance *instances;
+    MeshInstance *sorted;   // by group
+    int          *instGroup;
+    int          count, countMax;
+
+    int *table;             // hash of range & variant -> group index
+    int tableSize;
+
+    int variant;            // base shader of next instances
+
+    MeshBatch() : groups(NULL), groupsCount(0), groupsMax(0), instances(NULL), sorted(NULL), instGroup(NULL), count(0), countMax(0), table(NULL), tableSize(0), variant(0) {}
+
+    ~MeshBatch() {
+        delete[] groups;
+        delete[] instances;
+        delete[] sorted;
+        delete[] instGroup;
+        delete[] table;
+    }
+
+    static uint32 getHash(const MeshRange &range, int variant) {
+        return (uint32(range.iStart) * 2654435761U) ^ (uint32(range.buffer) * 40503U) ^ uint32(variant);
+    }
+
+    int getGroup(const MeshRange &range, bool alpha) {
+        if (groupsCount * 2 >= tableSize)
+            growGroups();
+
+        uint32 h = getHash(range, variant) & (tableSize - 1);
+        while (table[h] != -1) {
+            Group &g = groups[table[h]];
+            if (g.range.iStart == range.iStart && g.range.iCount == range.iCount && g.range.buffer == range.buffer && g.variant == variant && g.alpha == alpha)
+                return table[h];
+            h = (h + 1) & (tableSize - 1);
+        }
+
+        Group &g = groups[groupsCount];
+        g.range  = range;
+        g.variant = variant;
+        g.alpha   = alpha;
+        g.count  = 0;
+        return table[h] = groupsCount++;
+    }
+
+    void growGroups() {
+        groupsMax = max(64, groupsMax * 2);
+        Group *g = new Group[groupsMax];
+        memcpy(g, groups, groupsCount * sizeof(Group));
+        delete[] groups;
+        groups = g;
+
+        tableSize = groupsMax * 2;
+        delete[] table;
+        table = new int[tableSize];
+        memset(table, -1, tableSize * sizeof(int));
+        for (int i = 0; i < groupsCount; i++) {
+            uint32 h = getHash(groups[i].range, groups[i].variant) & (tableSize - 1);
+            while (table[h] != -1)
+                h = (h + 1) & (tableSize - 1);
+            table[h] = i;
+        }
+    }
+
+    MeshInstance* push(const MeshRange &range, const mat4 &model, const vec4 &color) {
+        if (!range.iCount) return NULL;
+
+        if (count == countMax) {
+            countMax = max(256, countMax * 2);
+            MeshInstance *inst = new MeshInstance[countMax];
+            int          *ig   = new int[countMax];
+            memcpy(inst, instances, count * sizeof(MeshInstance));
+            memcpy(ig, instGroup, count * sizeof(int));
+            delete[] instances;
+            delete[] instGroup;
+            delete[] sorted;
+            instances = inst;
+            instGroup = ig;
+            sorted    = new MeshInstance[countMax];
+        }
+
+        int index = getGroup(range, color.w < 1.0f);
+        groups[index].count++;
+        instGroup[count] = index;
+        MeshInstance *inst = &instances[count++];
+        inst->model = model;
+        inst->color = color;
+        return inst;
+    }
+
+// instance with explicit color & ambient (no light)
+    void add(const MeshRange &range, const mat4 &model, const vec4 &color, float ambient) {
+        MeshInstance *inst = push(range, model, color);
+        if (!inst) return;
+        inst->lightPos   = vec4(vec3(0.0f), ambient);
+        inst->lightColor = vec4(0, 0, 0, 1);
+    }
+
+// instance with current shading (Core::color, ambient & light 0)
+    void add(const MeshRange &range, const mat4 &model) {
+        MeshInstance *inst = push(range, model, Core::color);
+        if (!inst) return;
+        inst->lightPos   = vec4(Core::lightPos[0], Core::ambient.x);
+        inst->lightColor = Core::lightColor[0];
+    }
+
+// instances of every group are made contiguous
+    void sort() {
+        int first = 0;
+        for (int i = 0; i < groupsCount; i++) {
+            groups[i].first = first;
+            first += groups[i].count;
+            groups[i].count = 0;
+        }
+        for (int i = 0; i < count; i++) {
+            Group &g = groups[instGroup[i]];
+            sorted[g.first + g.count++] = instances[i];
+        }
+    }
+
+    void reset() {
+        count = groupsCount = 0;
+        if (table)
+            memset(table, -1, tableSize * sizeof(int));
+    }
+};
+
+// draws of visible geometry collected by traversal, sorted by key (layer, shader, depth) and submitted in one pass
+struct RenderQueue {
+    struct Item {
+        uint32       key;
+        Shader       *shader;
+        MeshRange    range;
+        MeshInstance params;   // model matrix, color & light 0 (as for instances)
+        short4       scissor;  // x, y, width & height in pixels
+    } *items;
+    uint64 *order;          // key << 32 | item index, sorted
+    int    count, countMax;
+
+    RenderQueue() : items(NULL), order(NULL), count(0), countMax(0) {}
+
+    ~RenderQueue() {
+        delete[] items;
+        delete[] order;
+    }
+
+// layer (2 bits), shader (6 bits), depth (24 bits, front to back)
+    static uint32 getKey(int layer, int shader, float depth) {
+        return (uint32(layer) << 30) | (uint32(shader & 63) << 24) | uint32(clamp(depth, 0.0f, float(0xFFFFFF)));
+    }
+
+    static int getLayer(uint32 key) {
+        return key >> 30;
+    }
+
+    void add(uint32 key, Shader *shader, const MeshRange &range, const short4 &scissor, const mat4 &model, const vec4 &color, float ambient, const vec3 &lightPos, const vec4 &lightColor) {
+        if (!range.iCount) return;
+
+        if (count == countMax) {
+            countMax = max(256, countMax * 2);
+            Item *i = new Item[countMax];
+            memcpy(i, items, count * sizeof(Item));
+            delete[] items;
+            delete[] order;
+            items = i;
+            order = new uint64[countMax];
+        }
+
+        Item &item = items[count++];
+        item.key    = key;
+        item.shader = shader;
+        item.range  = range;
+        item.scissor = scissor;
+        item.params.model      = model;
+        item.params.color      = color;
+        item.params.lightPos   = vec4(lightPos, ambient);
+        item.params.lightColor = lightColor;
+    }
+
+    static int cmpOrder(const void *a, const void *b) {
+        uint64 oa = *(uint64*)a, ob = *(uint64*)b;
+        return oa < ob ? -1 : (oa > ob ? 1 : 0);
+    }
+
+// equal keys keep traversal order
+    void sort() {
+        for (int i = 0; i < count; i++)
+            order[i] = (uint64(items[i].key) << 32) | uint32(i);
+        qsort(order, count, sizeof(order[0]), cmpOrder);
+    }
+
+    const Item& operator [] (int index) const {
+        return items[uint32(order[index])];
+    }
+
+    void reset() {
+        count = 0;
+    }
 };
 
 
@@ -116,6 +480,10 @@ struct Mesh {
             n.z = (int)o.z;
 
 
+// objects mesh data navigation (fields after variable size arrays)
+#define OFFSET(bytes) (ptr = (TR::Mesh*)((char*)ptr + (bytes) - sizeof(char*)))
+#define ALIGN4()      (ptr = (TR::Mesh*)((char*)level.meshData + ((((intptr_t)ptr - (intptr_t)level.meshData) + 3) & -4))) // relative to meshData (may be unaligned in file mapping)
+
 uint8 intensity(int lighting) {
     float a = 1.0f - (lighting >> 5) / 255.0f;
     return int(255 * a * a);
@@ -140,8 +508,26 @@ struct MeshBuilder {
     MeshRange *spriteSequences;
     MeshRange shadowBlob;
 
+// skinned models (all meshes of model in one range, joint index in coord.w), iCount is 0 if model is not skinned
+    MeshRange *modelRanges;
+    int       *skinMap;     // skinned model index by its first mesh index
+    int       jointsCount;  // max joints of skinned models
+
 // indexed mesh
     Mesh *mesh;
+    MeshBatch *batch;   // collects instances of entity models & sprites instead of drawing if not NULL
+    Shader *skinShader; // skinned variant of the active shader for models drawn by skinned ranges (NULL - per mesh draws)
+
+// geometry data for upload (points into baked cache or owned), vertices are in MeshVertex format after build
+    Index  *indices;    // 32-bit in fill pass
+    Vertex *vertices;
+    int    iCount;      // in Index units after build
+    int    vCount;
+    int    aCount;
+    bool   baked;
+
+    MeshBuffer *buffers;
+    int        buffersCount;
 
     vec2 *animTexRanges;
     vec2 *animTexOffsets;
@@ -149,28 +535,104 @@ struct MeshBuilder {
     int animTexRangesCount;
     int animTexOffsetsCount;
 
-    TR::Level *level;
+// objectTexture index -> first frame texture, range & frame of animation, transparent texels in any frame (build only)
+    struct AnimTexFrame {
+        int16 texture, range, frame, alpha;
+    } *animTexMap;
+    uint8 *faceAlpha; // alpha tested flag by triangle index (build only)
 
-    MeshBuilder(TR::Level &level) : level(&level) {
-        initAnimTextures(level);
+    TR::Level *level;
+    const Atlas::Layout *layout; // texture coordinates remap (build only)
+
+// geometry optimization stats (build only)
+    struct {
+        int     vCount[2];  // vertices before & after
+        int     misses[2];  // FIFO cache misses before & after
+        int     tCount;     // triangles in optimized ranges
+    } optStats;
+    bool optimize;
+    bool bakeStatic;    // static meshes of rooms are in room geometry (see getBakedMesh)
+
+// build phases timing in ms (build only)
+    struct {
+        double  animTex;    // anim texture ranges, offsets & lookup table
+        double  count;      // counting pass & buffers allocation
+        double  meshMap;    // meshOffsets -> meshInfo
+        double  fill;       // fill & optimize jobs, shadow spot
+        double  compact;    // vertex & index buffers compaction
+        double  total;
+    } buildTime;
+
+// fill pass ranges (build only)
+    struct Segment {
+        MeshRange   *range;
+        int         vCount[2];  // vertices before & after optimization
+        int         misses[2];  // FIFO cache misses before & after optimization
+        bool        optimized;
+        bool        sprite;     // texCoord.zw is sprite corner offset
+        bool        skinned;    // coord.w is joint index
+    } *segments;
+    int segmentsCount;
+    int modelsSegment;          // segment of the first model range
+
+    MeshBuilder(TR::Level &level) : roomRanges(NULL), meshInfo(NULL), mCount(0), meshMap(NULL), spriteSequences(NULL), modelRanges(NULL), skinMap(NULL), jointsCount(0), mesh(NULL), batch(NULL), skinShader(NULL), indices(NULL), vertices(NULL), iCount(0), vCount(0), aCount(0), baked(false), buffers(NULL), buffersCount(0), animTexRanges(NULL), animTexOffsets(NULL), animTexMap(NULL), faceAlpha(NULL), level(&level), layout(NULL), segments(NULL), segmentsCount(0) {
+        memset(&optStats, 0, sizeof(optStats));
+        memset(&buildTime, 0, sizeof(buildTime));
+    #ifdef MESH_BAKE_STATIC
+        bakeStatic = true;
+    #else
+        bakeStatic = false;
+    #endif
+    }
 
-    // create dummy white object textures for non-textured (colored) geometry
-        TR::ObjectTexture whiteTileQuad;
-        whiteTileQuad.attribute = 0;
-        whiteTileQuad.tile.index = 15;
-        whiteTileQuad.tile.triangle = 0;
-        whiteTileQuad.vertices[0] = 
-        whiteTileQuad.vertices[1] = 
-        whiteTileQuad.vertices[2] = 
-        whiteTileQuad.vertices[3] = { 0, 253, 0, 253 };
+// rooms geometry & objects meshes are optimized for vertex cache (sprites are not, their quads are unique and rendered by frames)
+// geometry of every room, object mesh & sprite sequence is filled by independent job at offsets of counting pass
+    void build(const Atlas::Layout &layout, bool optimize = true, int threads = 0) {
+        TR::Level &level = *this->level;
+        this->layout   = &layout;
+        this->optimize = optimize;
+        double start = Thread::getTime(), time = start;
 
-        TR::ObjectTexture whiteTileTri = whiteTileQuad;
-        whiteTileTri.tile.triangle = 1;
+        initAnimTextures(level);
+        buildTime.animTex = lap(time);
 
     // allocate room geometry ranges
         roomRanges = new RoomRange[level.roomsCount];
 
-        int iCount = 0, vCount = 0, aCount = 0;
+        iCount = vCount = aCount = 0;
+
+    // count meshes
+        mCount = 0;
+        int dummy = 0;
+        TR::Mesh *ptr = (TR::Mesh*)level.meshData;
+        while ( ((intptr_t)ptr - (intptr_t)level.meshData) < level.meshDataSize * 2 ) {
+            mCount++;
+            ptr = nextMesh(ptr, dummy, dummy);
+        }
+        meshInfo = new MeshInfo[mCount];
+        meshMap  = new MeshInfo*[level.meshOffsetsCount];
+        memset(meshMap, 0, sizeof(meshMap[0]) * level.meshOffsetsCount);
+
+    // get objects mesh info & geometry size
+        int *meshVertices = new int[mCount];
+        ptr = (TR::Mesh*)level.meshData;
+        for (int i = 0; i < mCount; i++) {
+            MeshInfo &info = meshInfo[i];
+            info.offset   = (intptr_t)ptr - (intptr_t)level.meshData;
+            info.center   = ptr->center;
+            info.collider = ptr->collider;
+            info.iCount   = meshVertices[i] = 0;
+            ptr = nextMesh(ptr, info.iCount, meshVertices[i]);
+        }
+        buildTime.count = lap(time);
+
+        initMeshMap(level);
+        buildTime.meshMap = lap(time);
+
+        spriteSequences = new MeshRange[level.spriteSequencesCount];
+
+        segmentsCount = 0;
+        segments = new Segment[level.roomsCount * 2 + mCount + level.spriteSequencesCount + 1 + level.modelsCount];
 
     // get size of mesh for rooms (geometry & sprites)
         for (int i = 0; i < level.roomsCount; i++) {
@@ -181,56 +643,38 @@ struct MeshBuilder {
             r.geometry.iStart = iCount;
             iCount += d.rCount * 6 + d.tCount * 3;
             vCount += d.rCount * 4 + d.tCount * 3;
+            for (int j = 0; j < level.rooms[i].meshesCount; j++) {
+                MeshInfo *info = getBakedMesh(i, level.rooms[i].meshes[j]);
+                if (!info) continue;
+                iCount += info->iCount;
+                vCount += meshVertices[info - meshInfo];
+            }
             r.geometry.iCount = iCount - r.geometry.iStart;
+            addSegment(r.geometry, vCount - r.geometry.vStart, true, false);
             
             r.sprites.vStart = vCount;
             r.sprites.iStart = iCount;
             iCount += d.sCount * 6;
             vCount += d.sCount * 4;
             r.sprites.iCount = iCount - r.sprites.iStart;
+            addSegment(r.sprites, vCount - r.sprites.vStart, false, true);
             if (r.sprites.iCount)
                 aCount++;
         }
         aCount += level.roomsCount;
 
-    // get objects mesh info
-        #define OFFSET(bytes) (ptr = (TR::Mesh*)((char*)ptr + (bytes) - sizeof(char*)))
-
-        mCount = 0;
-        TR::Mesh *ptr = (TR::Mesh*)level.meshData;
-        while ( ((intptr_t)ptr - (intptr_t)level.meshData) < level.meshDataSize * 2 ) {
-            mCount++;
-
-            OFFSET(ptr->vCount * sizeof(TR::Vertex));
-            if (ptr->nCount > 0)
-                OFFSET(ptr->nCount * sizeof(TR::Vertex));
-            else
-                OFFSET(-ptr->nCount * sizeof(int16));
-
-            iCount += ptr->rCount * 6;
-            vCount += ptr->rCount * 4;
-            OFFSET(ptr->rCount * sizeof(TR::Rectangle));
-
-            iCount += ptr->tCount * 3;
-            vCount += ptr->tCount * 3;
-            OFFSET(ptr->tCount * sizeof(TR::Triangle));
-
-            iCount += ptr->crCount * 6;
-            vCount += ptr->crCount * 4;
-            OFFSET(ptr->crCount * sizeof(TR::Rectangle));
-
-            iCount += ptr->ctCount * 3;
-            vCount += ptr->ctCount * 3;
-            OFFSET(ptr->ctCount * sizeof(TR::Triangle) + sizeof(TR::Mesh));
-            ptr = (TR::Mesh*)(((intptr_t)ptr + 3) & -4);
+    // get objects mesh ranges
+        for (int i = 0; i < mCount; i++) {
+            MeshInfo &info = meshInfo[i];
+            info.vStart = vCount;
+            info.iStart = iCount;
+            iCount += info.iCount;
+            vCount += meshVertices[i];
+            addSegment(info, meshVertices[i], true, false);
         }
         aCount += mCount;
-        meshInfo = new MeshInfo[mCount];
-        meshMap  = new MeshInfo*[level.meshOffsetsCount];
-        memset(meshMap, 0, sizeof(meshMap[0]) * level.meshOffsetsCount); 
         
     // get size of mesh for sprite sequences
-        spriteSequences = new MeshRange[level.spriteSequencesCount];
         for (int i = 0; i < level.spriteSequencesCount; i++) {
         // TODO: sequences not only first frame
             spriteSequences[i].vStart = vCount;
@@ -238,6 +682,7 @@ struct MeshBuilder {
             spriteSequences[i].iCount = level.spriteSequences[i].sCount * 6;
             iCount += level.spriteSequences[i].sCount * 6;
             vCount += level.spriteSequences[i].sCount * 4;
+            addSegment(spriteSequences[i], level.spriteSequences[i].sCount * 4, false, true);
         }
         aCount += level.spriteSequencesCount;
 
@@ -245,175 +690,624 @@ struct MeshBuilder {
         shadowBlob.vStart = vCount;
         shadowBlob.iStart = iCount;
         shadowBlob.iCount = 8 * 3;
+        addSegment(shadowBlob, 8, false, false);
         aCount++;
         iCount += shadowBlob.iCount;
         vCount += 8;
 
-    // make meshes buffer (single vertex buffer object for all geometry & sprites on level)
-        Index  *indices  = new Index[iCount];
-        Vertex *vertices = new Vertex[vCount];
-        iCount = vCount = 0;
+    // get size of skinned models (vertices of meshes before optimization)
+        modelRanges   = new MeshRange[level.modelsCount];
+        modelsSegment = segmentsCount;
+        for (int i = 0; i < level.modelsCount; i++) {
+            TR::Model &model = level.models[i];
+            MeshRange &range = modelRanges[i];
+            range.vStart = vCount;
+            range.iStart = iCount;
+            range.iCount = 0;
+
+            int mvCount = 0;
+            if (model.mCount > 1 && model.mCount <= MESH_MAX_JOINTS && model.mStart + model.mCount <= level.meshOffsetsCount)
+                for (int j = 0; j < model.mCount; j++) {
+                    MeshInfo *info = meshMap[model.mStart + j];
+                    if (!info) continue;
+                    range.iCount += info->iCount;
+                    mvCount      += meshVertices[info - meshInfo];
+                }
+            iCount += range.iCount;
+            vCount += mvCount;
+            addSegment(range, mvCount, false, false, true);
+            if (range.iCount)
+                aCount++;
+        }
+        delete[] meshVertices;
 
-    // build rooms
-        for (int i = 0; i < level.roomsCount; i++) {
-            TR::Room::Data &d = level.rooms[i].data;
+    // make meshes buffer (single vertex buffer object for all geometry & sprites on level, if fits MESH_BUFFER_SIZE)
+        indices  = new Index[iCount * 2];
+        vertices = new Vertex[vCount];
+        faceAlpha = new uint8[iCount / 3 + 1];
+        memset(faceAlpha, 0, iCount / 3 + 1);
+        buildTime.count += lap(time);
 
-        // rooms geometry
-            int vStart = vCount;
-            for (int j = 0; j < d.rCount; j++) {
-                TR::Rectangle     &f = d.rectangles[j];
-                TR::ObjectTexture &t = level.objectTextures[f.texture];
+    // fill geometry (object meshes first, their data is fixed in place (zero normals) and reused by baked static meshes of rooms & skinned models)
+        Thread::parallelFor(mCount, buildMeshProc, this, threads);
+        Thread::parallelFor(level.roomsCount + level.spriteSequencesCount + level.modelsCount, buildProc, this, threads);
 
-                addQuad(indices, iCount, vCount, vStart, vertices, &t);
+    // build shadow spot
+        short2 white = layout.getWhite();
+        for (int i = 0; i < 8; i++) {
+            Vertex &v = vertices[shadowBlob.vStart + i];
+            v.normal    = { 0, -1, 0, 0 };
+            v.color     = { 255, 255, 255, 0 };
+            v.texCoord  = { white.x, white.y, 0, 0 };
 
-                TR::Vertex n;
-                CHECK_ROOM_NORMAL(n);
+            float a = i * (PI / 4.0f) + (PI / 8.0f);
+            short c = short(cosf(a) * 512.0f);
+            short s = short(sinf(a) * 512.0f);
+            v.coord = { c, 0, s, 0 };
 
-                for (int k = 0; k < 4; k++) {
-                    TR::Room::Data::Vertex &v = d.vertices[f.vertices[k]];
-                    vertices[vCount].coord  = { v.vertex.x, v.vertex.y, v.vertex.z, 0 };
-                    vertices[vCount].color  = { 255, 255, 255, intensity(v.lighting) };
-                    vertices[vCount].normal = { n.x, n.y, n.z, 0 };
-                    vCount++;
-                }
+            uint32 *idx = (uint32*)indices + shadowBlob.iStart + i * 3;
+            idx[0] = i;
+            idx[1] = 0;
+            idx[2] = (i + 1) % 8;
+        }
+        buildTime.fill = lap(time);
+
+    // remove gaps left by optimized ranges, pack vertices & indices in place (packed strides are not greater)
+        buffers = new MeshBuffer[segmentsCount];
+        buffersCount = 0;
+        MeshBuffer *b = NULL;
+        iCount = vCount = 0;
+        memset(&optStats, 0, sizeof(optStats));
+        for (int i = 0; i < segmentsCount; i++) {
+            Segment   &s = segments[i];
+            MeshRange &r = *s.range;
+            r.index32 = s.vCount[1] > 0x10000;
+
+            int iSize = r.iCount * (r.index32 ? 2 : 1) + 1; // + alignment
+            if (!b || (b->iCount + iSize) * sizeof(Index) > MESH_BUFFER_SIZE || (b->vCount + s.vCount[1]) * sizeof(MeshVertex) > MESH_BUFFER_SIZE) {
+                b = &buffers[buffersCount++];
+                b->iStart = iCount;
+                b->vStart = vCount;
+                b->iCount = b->vCount = 0;
             }
 
-            for (int j = 0; j < d.tCount; j++) {
-                TR::Triangle      &f = d.triangles[j];
-                TR::ObjectTexture &t = level.objectTextures[f.texture];
+        #ifdef MESH_COMPACT
+            for (int j = 0; j < s.vCount[1]; j++) {
+                Vertex v = vertices[r.vStart + j];
+                MeshVertex c = MeshVertex::pack(v, s.sprite);
+                if (s.skinned)
+                    c.coord.w = v.coord.w;
+                ((MeshVertex*)vertices)[vCount + j] = c;
+            }
+        #else
+            memmove(vertices + vCount, vertices + r.vStart, s.vCount[1] * sizeof(Vertex));
+        #endif
+
+            uint32 *src = (uint32*)indices + r.iStart;
+            if (r.index32) {
+                iCount += (iCount - b->iStart) & 1; // 4-byte aligned in the buffer
+                memmove(indices + iCount, src, r.iCount * sizeof(uint32));
+            } else
+                for (int j = 0; j < r.iCount; j++)
+                    indices[iCount + j] = Index(src[j]);
+
+            r.buffer = buffersCount - 1;
+            r.iStart = iCount - b->iStart;
+            r.vStart = vCount - b->vStart;
+            iCount += r.iCount * (r.index32 ? 2 : 1);
+            vCount += s.vCount[1];
+            b->iCount = iCount - b->iStart;
+            b->vCount = vCount - b->vStart;
+
+            if (!s.optimized) continue;
+            optStats.vCount[0] += s.vCount[0];
+            optStats.vCount[1] += s.vCount[1];
+            optStats.misses[0] += s.misses[0];
+            optStats.misses[1] += s.misses[1];
+            optStats.tCount    += s.range->iCount / 3;
+        }
+        delete[] segments;
+        segments = NULL;
+        delete[] animTexMap;
+        animTexMap = NULL;
+        delete[] faceAlpha;
+        faceAlpha = NULL;
+        buildTime.compact = lap(time);
+
+        if (buffersCount > 1) {
+            LOG("mesh: geometry is split into %d buffers\n", buffersCount);
+        }
 
-                addTriangle(indices, iCount, vCount, vStart, vertices, &t);
+        initSkinMap();
 
-                TR::Vertex n;
-                CHECK_ROOM_NORMAL(n);
+        this->layout = NULL;
+        buildTime.total = time - start;
 
-                for (int k = 0; k < 3; k++) {
-                    auto &v = d.vertices[f.vertices[k]];
-                    vertices[vCount].coord  = { v.vertex.x, v.vertex.y, v.vertex.z, 0 };
-                    vertices[vCount].color  = { 255, 255, 255, intensity(v.lighting) };
-                    vertices[vCount].normal = { n.x, n.y, n.z, 0 };
-                    vCount++;
-                }
+        LOG("mesh: %d -> %d vertices, ACMR %.3f -> %.3f, built in %.1f ms (anim %.1f, count %.1f, map %.1f, fill %.1f, compact %.1f)\n", optStats.vCount[0], optStats.vCount[1],
+            (float)optStats.misses[0] / max(1, optStats.tCount), (float)optStats.misses[1] / max(1, optStats.tCount), buildTime.total,
+            buildTime.animTex, buildTime.count, buildTime.meshMap, buildTime.fill, buildTime.compact);
+    }
+
+// elapsed time since the last lap
+    static double lap(double &time) {
+        double t = Thread::getTime(), dt = t - time;
+        time = t;
+        return dt;
+    }
+
+// meshInfo by offset of mesh data (open addressing hash table), zero offset is mapped for the first mesh only
+    void initMeshMap(TR::Level &level) {
+        int size = 1;
+        while (size < mCount * 2)
+            size <<= 1;
+        int *table = new int[size];
+        memset(table, -1, size * sizeof(int));
+
+        for (int i = 0; i < mCount; i++) {
+            uint32 h = uint32(meshInfo[i].offset * 2654435761u) & (size - 1);
+            while (table[h] != -1)
+                h = (h + 1) & (size - 1);
+            table[h] = i;
+        }
+
+        for (int j = 0; j < level.meshOffsetsCount; j++) {
+            int offset = level.meshOffsets[j];
+            if (!offset && j) continue;
+            uint32 h = uint32(offset * 2654435761u) & (size - 1);
+            while (table[h] != -1 && meshInfo[table[h]].offset != offset)
+                h = (h + 1) & (size - 1);
+            if (table[h] != -1)
+                meshMap[j] = &meshInfo[table[h]];
+        }
+
+        delete[] table;
+    }
+
+    void addSegment(MeshRange &range, int vCount, bool optimized, bool sprite, bool skinned = false) {
+        Segment &s = segments[segmentsCount++];
+        s.range     = &range;
+        s.vCount[0] = s.vCount[1] = vCount;
+        s.misses[0] = s.misses[1] = 0;
+        s.optimized = optimized;
+        s.sprite    = sprite;
+        s.skinned   = skinned;
+    }
+
+// skinned model index by first mesh index of model
+    void initSkinMap() {
+        skinMap = new int[level->meshOffsetsCount];
+        memset(skinMap, -1, level->meshOffsetsCount * sizeof(int));
+        jointsCount = 0;
+        for (int i = 0; i < level->modelsCount; i++) {
+            TR::Model &model = level->models[i];
+            if (!modelRanges[i].iCount || skinMap[model.mStart] != -1) continue;
+            skinMap[model.mStart] = i;
+            jointsCount = max(jointsCount, (int)model.mCount);
+        }
+    }
+
+// move opaque faces of range first (stable), returns their indices count
+    int splitAlpha(const MeshRange &range) {
+        uint32 *rIndices = (uint32*)indices + range.iStart;
+        uint8  *alpha    = faceAlpha + range.iStart / 3;
+        int    tCount    = range.iCount / 3;
+
+        int opaque = 0;
+        for (int i = 0; i < tCount; i++)
+            opaque += !alpha[i];
+        if (opaque == 0 || opaque == tCount)
+            return opaque * 3;
+
+        uint32 *temp = new uint32[range.iCount];
+        int o = 0, a = opaque;
+        for (int i = 0; i < tCount; i++)
+            memcpy(temp + (alpha[i] ? a++ : o++) * 3, rIndices + i * 3, 3 * sizeof(uint32));
+        memcpy(rIndices, temp, range.iCount * sizeof(uint32));
+        delete[] temp;
+        return opaque * 3;
+    }
+
+// optimize geometry of segment with vertices up to vEnd (opaque and alpha tested faces separately)
+    void finishSegment(int index, int vEnd) {
+        Segment &s = segments[index];
+        if (!s.optimized) return;
+        MeshRange &range  = *s.range;
+        uint32 *rIndices  = (uint32*)indices + range.iStart;
+        Vertex *rVertices = vertices + range.vStart;
+        int    count      = vEnd - range.vStart;
+
+        range.iOpaque = splitAlpha(range);
+        s.misses[0] = Optimizer::getCacheMisses(rIndices, range.iCount);
+        if (optimize)
+            count = Optimizer::optimize(rVertices, count, rIndices, range.iCount, range.iOpaque);
+        s.vCount[1] = count;
+        s.misses[1] = Optimizer::getCacheMisses(rIndices, range.iCount);
+    }
+
+// skip mesh data, adds geometry size of mesh to iCount & vCount, returns next mesh
+    TR::Mesh* nextMesh(TR::Mesh *ptr, int &iCount, int &vCount) {
+        TR::Level &level = *this->level;
+
+        OFFSET(ptr->vCount * sizeof(TR::Vertex));
+        if (ptr->nCount > 0)
+            OFFSET(ptr->nCount * sizeof(TR::Vertex));
+        else
+            OFFSET(-ptr->nCount * sizeof(int16));
+
+        iCount += ptr->rCount * 6;
+        vCount += ptr->rCount * 4;
+        OFFSET(ptr->rCount * sizeof(TR::Rectangle));
+
+        iCount += ptr->tCount * 3;
+        vCount += ptr->tCount * 3;
+        OFFSET(ptr->tCount * sizeof(TR::Triangle));
+
+        iCount += ptr->crCount * 6;
+        vCount += ptr->crCount * 4;
+        OFFSET(ptr->crCount * sizeof(TR::Rectangle));
+
+        iCount += ptr->ctCount * 3;
+        vCount += ptr->ctCount * 3;
+        OFFSET(ptr->ctCount * sizeof(TR::Triangle) + sizeof(TR::Mesh));
+        ALIGN4();
+        return ptr;
+    }
+
+    static void buildMeshProc(void *arg, int index) {
+        ((MeshBuilder*)arg)->buildMesh(index);
+    }
+
+    static void buildProc(void *arg, int index) {
+        MeshBuilder *builder = (MeshBuilder*)arg;
+        TR::Level &level = *builder->level;
+        if (index < level.roomsCount)
+            builder->buildRoom(index);
+        else if (index < level.roomsCount + level.spriteSequencesCount)
+            builder->buildSpriteSequence(index - level.roomsCount);
+        else
+            builder->buildModel(index - level.roomsCount - level.spriteSequencesCount);
+    }
+
+    void buildRoom(int index) {
+        TR::Level &level = *this->level;
+        uint32 *indices = (uint32*)this->indices;
+        TR::Room::Data &d = level.rooms[index].data;
+        RoomRange &range = roomRanges[index];
+        int iCount = range.geometry.iStart;
+        int vCount = range.geometry.vStart;
+
+    // rooms geometry
+        int vStart = vCount;
+        for (int j = 0; j < d.rCount; j++) {
+            TR::Rectangle     &f = d.rectangles[j];
+            TR::ObjectTexture &t = level.objectTextures[f.texture];
+
+            addQuad(indices, iCount, vCount, vStart, vertices, &t);
+
+            TR::Vertex n;
+            CHECK_ROOM_NORMAL(n);
+
+            for (int k = 0; k < 4; k++) {
+                TR::Room::Data::Vertex &v = d.vertices[f.vertices[k]];
+                vertices[vCount].coord  = { v.vertex.x, v.vertex.y, v.vertex.z, 0 };
+                vertices[vCount].color  = { 255, 255, 255, intensity(v.lighting) };
+                vertices[vCount].normal = { n.x, n.y, n.z, 0 };
+                vCount++;
             }
+        }
+
+        for (int j = 0; j < d.tCount; j++) {
+            TR::Triangle      &f = d.triangles[j];
+            TR::ObjectTexture &t = level.objectTextures[f.texture];
 
-        // rooms sprites
-            TR::Room::Info &info = level.rooms[i].info;
-            vStart = vCount;
-            for (int j = 0; j < d.sCount; j++) {
-                TR::Room::Data::Sprite &f = d.sprites[j];
-                TR::Room::Data::Vertex &v = d.vertices[f.vertex];
-                TR::SpriteTexture &sprite = level.spriteTextures[f.texture];
+            addTriangle(indices, iCount, vCount, vStart, vertices, &t);
 
-                addSprite(indices, vertices, iCount, vCount, vStart, v.vertex.x, v.vertex.y, v.vertex.z, sprite, intensity(v.lighting));
+            TR::Vertex n;
+            CHECK_ROOM_NORMAL(n);
+
+            for (int k = 0; k < 3; k++) {
+                auto &v = d.vertices[f.vertices[k]];
+                vertices[vCount].coord  = { v.vertex.x, v.vertex.y, v.vertex.z, 0 };
+                vertices[vCount].color  = { 255, 255, 255, intensity(v.lighting) };
+                vertices[vCount].normal = { n.x, n.y, n.z, 0 };
+                vCount++;
             }
         }
 
-    // build objects geometry
-        ptr = (TR::Mesh*)level.meshData;
-        for (int i = 0; i < mCount; i++) {
-            MeshInfo &info = meshInfo[i];
-            info.offset   = (intptr_t)ptr - (intptr_t)level.meshData;
-            info.vStart   = vCount;
-            info.iStart   = iCount;
-            info.center   = ptr->center;
-            info.collider = ptr->collider;
+        for (int j = 0; j < level.rooms[index].meshesCount; j++)
+            bakeStaticMesh(index, level.rooms[index].meshes[j], iCount, vCount, vStart);
 
-            if (!info.offset)
-                meshMap[0] = &info;
-            else
-                for (int j = 0; j < level.meshOffsetsCount; j++)
-                    if (info.offset == level.meshOffsets[j])
-                        meshMap[j] = &info;
+        finishSegment(index * 2, vCount);
 
-            TR::Vertex *mVertices = (TR::Vertex*)&ptr->vertices;
+    // rooms sprites
+        iCount = range.sprites.iStart;
+        vCount = range.sprites.vStart;
+        vStart = vCount;
+        for (int j = 0; j < d.sCount; j++) {
+            TR::Room::Data::Sprite &f = d.sprites[j];
+            TR::Room::Data::Vertex &v = d.vertices[f.vertex];
+            TR::SpriteTexture &sprite = level.spriteTextures[f.texture];
 
-            OFFSET(ptr->vCount * sizeof(TR::Vertex));
+            addSprite(indices, vertices, iCount, vCount, vStart, v.vertex.x, v.vertex.y, v.vertex.z, sprite, intensity(v.lighting));
+        }
+    }
 
-            TR::Vertex  *normals = NULL;
-            int16       *lights  = NULL;
-            int         nCount   = ptr->nCount;
+// static mesh drawn as a part of room geometry (box inside the room, so room scissor doesn't clip it), NULL if drawn separately
+    MeshInfo* getBakedMesh(int roomIndex, const TR::Room::Mesh &rMesh) const {
+        if (!bakeStatic) return NULL;
+        TR::StaticMesh *sMesh = level->getMeshByID(rMesh.meshID);
+        if (!sMesh || !meshMap[sMesh->mesh]) return NULL;
+
+        const TR::Room &room = level->rooms[roomIndex];
+        Box box;
+        sMesh->getBox(false, rMesh.rotation, box);
+        vec3 bMin = vec3(float(rMesh.x), float(rMesh.y), float(rMesh.z)) + box.min;
+        vec3 bMax = vec3(float(rMesh.x), float(rMesh.y), float(rMesh.z)) + box.max;
+        if (bMin.x < room.info.x || bMin.y < room.info.yTop || bMin.z < room.info.z ||
+            bMax.x > room.info.x + room.xSectors * 1024 || bMax.y > room.info.yBottom || bMax.z > room.info.z + room.zSectors * 1024)
+            return NULL;
+
+        return meshMap[sMesh->mesh];
+    }
 
-            if (nCount > 0) {
-                normals = (TR::Vertex*)&ptr->normals;
-                OFFSET(ptr->nCount * sizeof(TR::Vertex));
-            } else {
-                lights = (int16*)&ptr->lights;
-                OFFSET(-ptr->nCount * sizeof(int16));
+// copy of built static mesh in room space, light of Level::getLight is baked into vertex intensity
+// (per vertex, view dependent backlight term is taken at its average over the lit side)
+    void bakeStaticMesh(int roomIndex, const TR::Room::Mesh &rMesh, int &iCount, int &vCount, int vStart) {
+        MeshInfo *info = getBakedMesh(roomIndex, rMesh);
+        if (!info) return;
+
+        uint32 *rIndices = (uint32*)indices;
+        uint32 *src      = rIndices + info->iStart;
+        int    count     = segments[level->roomsCount * 2 + int(info - meshInfo)].vCount[1];
+
+    // faces are split by alpha already
+        for (int i = 0; i < info->iCount; i++)
+            rIndices[iCount + i] = src[i] + vCount - vStart;
+        memset(faceAlpha + iCount / 3, 0, info->iOpaque / 3);
+        memset(faceAlpha + (iCount + info->iOpaque) / 3, 1, (info->iCount - info->iOpaque) / 3);
+        iCount += info->iCount;
+
+        TR::Room &room = level->rooms[roomIndex];
+        vec3 pos    = vec3(float(rMesh.x), float(rMesh.y), float(rMesh.z));
+        vec3 offset = vec3(float(room.info.x), 0.0f, float(room.info.z));
+
+    // nearest light of the room (as Level::getLightIndex)
+        TR::Room::Light *light = NULL;
+        float dist = 0.0f;
+        for (int i = 0; i < room.lightsCount; i++) {
+            TR::Room::Light &l = room.lights[i];
+            float d = (pos - vec3(float(l.x), float(l.y), float(l.z))).length2();
+            if (!light || d < dist) {
+                light = &l;
+                dist  = d;
             }
+        }
 
-            int vStart = vCount;
-            short4 pn = { 0 };
-        // rectangles
-            for (int j = 0; j < ptr->rCount; j++) {
-                TR::Rectangle     &f = ((TR::Rectangle*)&ptr->rectangles)[j];
-                TR::ObjectTexture &t = level.objectTextures[f.texture];
+        mat4 m;
+        m.identity();
+        m.rotateY(rMesh.rotation);
 
-                addQuad(indices, iCount, vCount, vStart, vertices, &t);
+        for (int i = 0; i < count; i++) {
+            Vertex &v = vertices[vCount + i];
+            v = vertices[info->vStart + i];
 
-                short4 normal;
-                if (!normals) {
-                    TR::Vertex n = { 0, 0, 0 };
-                    CHECK_NORMAL(n);
-                    normal = { n.x, n.y, n.z, 0 };
+            vec3 p = m * vec3(v.coord.x, v.coord.y, v.coord.z) + (pos - offset);
+            vec3 n = m * vec3(v.normal.x, v.normal.y, v.normal.z);
+
+            if (light && light->attenuation) {
+                vec3  lv  = vec3(float(light->x), float(light->y), float(light->z)) - (p + offset);
+                float lum = max(0.0f, n.normal().dot(lv.normal()));
+                float att = max(0.0f, 1.0f - lv.length2() / ((float)light->attenuation * (float)light->attenuation));
+                float c   = light->intensity / 8191.0f * lum * att * 0.75f;
+                v.color.w = uint8(min(255.0f, v.color.w + c * 255.0f + 0.5f));
+            }
+
+            v.coord.x  = int16(roundf(p.x));
+            v.coord.y  = int16(roundf(p.y));
+            v.coord.z  = int16(roundf(p.z));
+            v.normal.x = int16(roundf(n.x));
+            v.normal.y = int16(roundf(n.y));
+            v.normal.z = int16(roundf(n.z));
+        }
+        vCount += count;
+    }
+
+    void buildMesh(int index) {
+        MeshInfo &info = meshInfo[index];
+        int iCount = info.iStart;
+        int vCount = info.vStart;
+        fillMesh(info, iCount, vCount, info.vStart);
+        finishSegment(level->roomsCount * 2 + index, vCount);
+    }
+
+// copy of model meshes with joint index (meshes are optimized already)
+    void buildModel(int index) {
+        TR::Model &model = level->models[index];
+        MeshRange &range = modelRanges[index];
+        Segment   &s     = segments[modelsSegment + index];
+        if (!range.iCount) return;
+
+        uint32 *rIndices  = (uint32*)indices + range.iStart;
+        Vertex *rVertices = vertices + range.vStart;
+        int iCount = 0, vCount = 0;
+
+    // opaque faces of all meshes first
+        range.iOpaque = 0;
+        for (int j = 0; j < model.mCount; j++) {
+            MeshInfo *info = meshMap[model.mStart + j];
+            if (info) range.iOpaque += info->iOpaque;
+        }
+
+        int aCount = range.iOpaque;
+        for (int j = 0; j < model.mCount; j++) {
+            MeshInfo *info = meshMap[model.mStart + j];
+            if (!info) continue;
+            uint32 *src   = (uint32*)indices + info->iStart;
+            int    count  = segments[level->roomsCount * 2 + int(info - meshInfo)].vCount[1];
+
+            for (int k = 0; k < info->iOpaque; k++)
+                rIndices[iCount + k] = src[k] + vCount;
+            for (int k = info->iOpaque; k < info->iCount; k++)
+                rIndices[aCount + k - info->iOpaque] = src[k] + vCount;
+
+            for (int k = 0; k < count; k++) {
+                Vertex &v = rVertices[vCount + k];
+                v = vertices[info->vStart + k];
+            #ifdef MESH_COMPACT
+                if (v.texCoord.z) { // no room for anim tex range & frame in coord.w
+                    range.iCount = s.vCount[1] = 0;
+                    return;
                 }
+            #endif
+                v.coord.w = j;
+            }
+            iCount += info->iOpaque;
+            aCount += info->iCount - info->iOpaque;
+            vCount += count;
+        }
+        s.vCount[1] = vCount;
+    }
+
+// geometry of object mesh with indices relative to vStart
+    void fillMesh(const MeshInfo &info, int &iCount, int &vCount, int vStart) {
+        TR::Level &level = *this->level;
+        uint32 *indices = (uint32*)this->indices;
+        TR::Mesh *ptr  = (TR::Mesh*)((char*)level.meshData + info.offset);
+
+    // dummy white object textures for non-textured (colored) geometry (not in the level, refer to white block of the atlas)
+        TR::ObjectTexture whiteTileQuad;
+        whiteTileQuad.attribute = 0;
+        whiteTileQuad.tile.index = 0;
+        whiteTileQuad.tile.triangle = 0;
+
+        TR::ObjectTexture whiteTileTri = whiteTileQuad;
+        whiteTileTri.tile.triangle = 1;
+
+        TR::Vertex *mVertices = (TR::Vertex*)&ptr->vertices;
+
+        OFFSET(ptr->vCount * sizeof(TR::Vertex));
+
+        TR::Vertex  *normals = NULL;
+        int16       *lights  = NULL;
+        int         nCount   = ptr->nCount;
+
+        if (nCount > 0) {
+            normals = (TR::Vertex*)&ptr->normals;
+            OFFSET(ptr->nCount * sizeof(TR::Vertex));
+        } else {
+            lights = (int16*)&ptr->lights;
+            OFFSET(-ptr->nCount * sizeof(int16));
+        }
 
-                for (int k = 0; k < 4; k++) {
-                    TR::Vertex &v  = mVertices[f.vertices[k]];
-
-                    vertices[vCount].coord = { v.x, v.y, v.z, 0 };
-
-                    if (normals) {
-                        TR::Vertex &n = normals[f.vertices[k]];
-                        CHECK_NORMAL(n);
-                        vertices[vCount].normal = { n.x, n.y, n.z, 0 };
-                        vertices[vCount].color  = { 255, 255, 255, 0 };
-                    } else {
-                        vertices[vCount].normal = normal;
-                        vertices[vCount].color  = { 255, 255, 255, intensity(lights[f.vertices[k]]) };
-                    }
-                    vCount++;
+    // rectangles
+        for (int j = 0; j < ptr->rCount; j++) {
+            TR::Rectangle     &f = ((TR::Rectangle*)&ptr->rectangles)[j];
+            TR::ObjectTexture &t = level.objectTextures[f.texture];
+
+            addQuad(indices, iCount, vCount, vStart, vertices, &t);
+
+            short4 normal;
+            if (!normals) {
+                TR::Vertex n = { 0, 0, 0 };
+                CHECK_NORMAL(n);
+                normal = { n.x, n.y, n.z, 0 };
+            }
+
+            for (int k = 0; k < 4; k++) {
+                TR::Vertex &v  = mVertices[f.vertices[k]];
+
+                vertices[vCount].coord = { v.x, v.y, v.z, 0 };
+
+                if (normals) {
+                    TR::Vertex &n = normals[f.vertices[k]];
+                    CHECK_NORMAL(n);
+                    vertices[vCount].normal = { n.x, n.y, n.z, 0 };
+                    vertices[vCount].color  = { 255, 255, 255, 0 };
+                } else {
+                    vertices[vCount].normal = normal;
+                    vertices[vCount].color  = { 255, 255, 255, intensity(lights[f.vertices[k]]) };
                 }
+                vCount++;
             }
-            OFFSET(ptr->rCount * sizeof(TR::Rectangle));
+        }
+        OFFSET(ptr->rCount * sizeof(TR::Rectangle));
 
-        // triangles
-            for (int j = 0; j < ptr->tCount; j++) {
-                TR::Triangle      &f = ((TR::Triangle*)&ptr->triangles)[j];
-                TR::ObjectTexture &t = level.objectTextures[f.texture];
+    // triangles
+        for (int j = 0; j < ptr->tCount; j++) {
+            TR::Triangle      &f = ((TR::Triangle*)&ptr->triangles)[j];
+            TR::ObjectTexture &t = level.objectTextures[f.texture];
 
-                addTriangle(indices, iCount, vCount, vStart, vertices, &t);
+            addTriangle(indices, iCount, vCount, vStart, vertices, &t);
 
-                short4 normal;
-                if (!normals) {
-                    TR::Vertex n = { 0, 0, 0 };
+            short4 normal;
+            if (!normals) {
+                TR::Vertex n = { 0, 0, 0 };
+                CHECK_NORMAL(n);
+                normal = { n.x, n.y, n.z, 0 };
+            }
+
+            for (int k = 0; k < 3; k++) {
+                auto &v = mVertices[f.vertices[k]];
+                vertices[vCount].coord = { v.x, v.y, v.z, 0 };
+
+                if (normals) {
+                    TR::Vertex &n = normals[f.vertices[k]];
                     CHECK_NORMAL(n);
-                    normal = { n.x, n.y, n.z, 0 };
+                    vertices[vCount].normal = { n.x, n.y, n.z, 0 };
+                    vertices[vCount].color  = { 255, 255, 255, 0 };
+                } else {
+                    vertices[vCount].normal = normal;
+                    vertices[vCount].color  = { 255, 255, 255, intensity(lights[f.vertices[k]]) };
                 }
+                vCount++;
+            }
+        }
+        OFFSET(ptr->tCount * sizeof(TR::Triangle));
+
+    // color rectangles
+        for (int j = 0; j < ptr->crCount; j++) {
+            TR::Rectangle &f = ((TR::Rectangle*)&ptr->crectangles)[j];
+            TR::RGB       &c = level.palette[f.texture & 0xFF];
+
+            addQuad(indices, iCount, vCount, vStart, vertices, &whiteTileQuad);
+
+            short4 normal;
+            if (!normals) {
+                TR::Vertex n = { 0, 0, 0 };
+                CHECK_NORMAL(n);
+                normal = { n.x, n.y, n.z, 0 };
+            }
+
+            for (int k = 0; k < 4; k++) {
+                auto &v = mVertices[f.vertices[k]];
+
+                vertices[vCount].coord = { v.x, v.y, v.z, 0 };
 
-                for (int k = 0; k < 3; k++) {
-                    auto &v = mVertices[f.vertices[k]];
-                    vertices[vCount].coord = { v.x, v.y, v.z, 0 };
-
-                    if (normals) {
-                        TR::Vertex &n = normals[f.vertices[k]];
-                        CHECK_NORMAL(n);
-                        vertices[vCount].normal = { n.x, n.y, n.z, 0 };
-                        vertices[vCount].color  = { 255, 255, 255, 0 };
-                    } else {
-                        vertices[vCount].normal = normal;
-                        vertices[vCount].color  = { 255, 255, 255, intensity(lights[f.vertices[k]]) };
-                    }
-                    vCount++;
+                if (normals) {
+                    TR::Vertex &n = normals[f.vertices[k]];
+                    CHECK_NORMAL(n);
+                    vertices[vCount].normal = { n.x, n.y, n.z, 0 };
+                    vertices[vCount].color  = { c.r, c.g, c.b, 0 };
+                } else {
+                    vertices[vCount].normal = normal;
+                    vertices[vCount].color  = { c.r, c.g, c.b, intensity(lights[f.vertices[k]]) };
                 }
+                vCount++;
             }
-            OFFSET(ptr->tCount * sizeof(TR::Triangle));
+        }
+        OFFSET(ptr->crCount * sizeof(TR::Rectangle));
 
-        // color rectangles
-            for (int j = 0; j < ptr->crCount; j++) {
-                TR::Rectangle &f = ((TR::Rectangle*)&ptr->crectangles)[j];
-                TR::RGB       &c = level.palette[f.texture & 0xFF];
+    // color triangles
+        for (int j = 0; j < ptr->ctCount; j++) {
+            TR::Triangle &f = ((TR::Triangle*)&ptr->ctriangles)[j];
+            TR::RGB      &c = level.palette[f.texture & 0xFF];
 
-                addQuad(indices, iCount, vCount, vStart, vertices, &whiteTileQuad);
+            addTriangle(indices, iCount, vCount, vStart, vertices, &whiteTileTri);
+
+            for (int k = 0; k < 3; k++) {
+                auto &v = mVertices[f.vertices[k]];
+
+                vertices[vCount].coord = { v.x, v.y, v.z, 0 };
 
                 short4 normal;
                 if (!normals) {
@@ -422,127 +1316,187 @@ struct MeshBuilder {
                     normal = { n.x, n.y, n.z, 0 };
                 }
 
-                for (int k = 0; k < 4; k++) {
-                    auto &v = mVertices[f.vertices[k]];
-
-                    vertices[vCount].coord = { v.x, v.y, v.z, 0 };
-
-                    if (normals) {
-                        TR::Vertex &n = normals[f.vertices[k]];
-                        CHECK_NORMAL(n);
-                        vertices[vCount].normal = { n.x, n.y, n.z, 0 };
-                        vertices[vCount].color  = { c.r, c.g, c.b, 0 };
-                    } else {
-                        vertices[vCount].normal = normal;
-                        vertices[vCount].color  = { c.r, c.g, c.b, intensity(lights[f.vertices[k]]) };
-                    }
-                    vCount++;
-                }
-            }
-            OFFSET(ptr->crCount * sizeof(TR::Rectangle));
-
-        // color triangles
-            for (int j = 0; j < ptr->ctCount; j++) {
-                TR::Triangle &f = ((TR::Triangle*)&ptr->ctriangles)[j];
-                TR::RGB      &c = level.palette[f.texture & 0xFF];
-
-                addTriangle(indices, iCount, vCount, vStart, vertices, &whiteTileTri);
-
-                for (int k = 0; k < 3; k++) {
-                    auto &v = mVertices[f.vertices[k]];
-
-                    vertices[vCount].coord = { v.x, v.y, v.z, 0 };
-
-                    short4 normal;
-                    if (!normals) {
-                        TR::Vertex n = { 0, 0, 0 };
-                        CHECK_NORMAL(n);
-                        normal = { n.x, n.y, n.z, 0 };
-                    }
-
-                    if (normals) {
-                        TR::Vertex &n = normals[f.vertices[k]];
-                        CHECK_NORMAL(n);
-                        vertices[vCount].normal = { n.x, n.y, n.z, 0 };
-                        vertices[vCount].color  = { c.r, c.g, c.b, 0 };
-                    } else {
-                        vertices[vCount].normal = normal;
-                        vertices[vCount].color  = { c.r, c.g, c.b, intensity(lights[f.vertices[k]]) };
-                    }
-                    vCount++;
+                if (normals) {
+                    TR::Vertex &n = normals[f.vertices[k]];
+                    CHECK_NORMAL(n);
+                    vertices[vCount].normal = { n.x, n.y, n.z, 0 };
+                    vertices[vCount].color  = { c.r, c.g, c.b, 0 };
+                } else {
+                    vertices[vCount].normal = normal;
+                    vertices[vCount].color  = { c.r, c.g, c.b, intensity(lights[f.vertices[k]]) };
                 }
+                vCount++;
             }
-            info.iCount = iCount - info.iStart;
-
-            OFFSET(ptr->ctCount * sizeof(TR::Triangle) + sizeof(TR::Mesh));
-            ptr = (TR::Mesh*)(((intptr_t)ptr + 3) & -4);
         }
+    }
 
-    // build sprite sequences
-        for (int i = 0; i < level.spriteSequencesCount; i++) 
-            for (int j = 0; j < level.spriteSequences[i].sCount; j++) {
-                TR::SpriteTexture &sprite = level.spriteTextures[level.spriteSequences[i].sStart + j];
-                addSprite(indices, vertices, iCount, vCount, spriteSequences[i].vStart, 0, 0, 0, sprite, 255);
-            }
-
-    // build shadow spot
-        for (int i = 0; i < 8; i++) {
-            Vertex &v = vertices[vCount + i];
-            v.normal    = { 0, -1, 0, 0 };
-            v.color     = { 255, 255, 255, 0 };
-            v.texCoord  = { 32688, 32688, 0, 0 };
+    void buildSpriteSequence(int index) {
+        TR::Level &level = *this->level;
+        uint32 *indices = (uint32*)this->indices;
+        MeshRange &range = spriteSequences[index];
+        int iCount = range.iStart;
+        int vCount = range.vStart;
+        for (int j = 0; j < level.spriteSequences[index].sCount; j++) {
+            TR::SpriteTexture &sprite = level.spriteTextures[level.spriteSequences[index].sStart + j];
+            addSprite(indices, vertices, iCount, vCount, range.vStart, 0, 0, 0, sprite, 255);
+        }
+    }
 
-            float a = i * (PI / 4.0f) + (PI / 8.0f);
-            short c = short(cosf(a) * 512.0f);
-            short s = short(sinf(a) * 512.0f);
-            v.coord = { c, 0, s, 0 };
+    ~MeshBuilder() {
+        freeGeometry();
+        delete[] animTexRanges;
+        delete[] animTexOffsets;
+        delete[] animTexMap;
+        delete[] faceAlpha;
+        delete[] roomRanges;
+        delete[] meshInfo;
+        delete[] meshMap;
+        delete[] spriteSequences;
+        delete[] modelRanges;
+        delete[] skinMap;
+        delete[] buffers;
+        delete mesh;
+    }
 
-            int idx = iCount + i * 3;
-            indices[idx + 0] = i;
-            indices[idx + 1] = 0;
-            indices[idx + 2] = (i + 1) % 8;
+    void freeGeometry() {
+        if (!baked) {
+            delete[] indices;
+            delete[] vertices;
         }
-        iCount += shadowBlob.iCount;
-        vCount += 8;
+        indices  = NULL;
+        vertices = NULL;
+    }
 
-        mesh = new Mesh(indices, iCount, vertices, vCount, aCount);
-        delete[] indices;
-        delete[] vertices;
+// create GPU buffers & vertex arrays, geometry data is not needed after that
+    void upload() {
+        mesh = new Mesh(indices, iCount, (MeshVertex*)vertices, vCount, aCount, buffers, buffersCount);
+        freeGeometry();
 
         PROFILE_LABEL(BUFFER, mesh->ID[0], "Geometry indices");
         PROFILE_LABEL(BUFFER, mesh->ID[1], "Geometry vertices");
 
         // initialize Vertex Arrays
-        for (int i = 0; i < level.roomsCount; i++) {
+        for (int i = 0; i < level->roomsCount; i++) {
             RoomRange &r = roomRanges[i];
             mesh->initRange(r.geometry);
             if (r.sprites.iCount)
                 mesh->initRange(r.sprites);
         }
 
-        for (int i = 0; i < level.spriteSequencesCount; i++)
+        for (int i = 0; i < level->spriteSequencesCount; i++)
             mesh->initRange(spriteSequences[i]);       
         for (int i = 0; i < mCount; i++)
             mesh->initRange(meshInfo[i]);
         mesh->initRange(shadowBlob);
+        for (int i = 0; i < level->modelsCount; i++)
+            if (modelRanges[i].iCount)
+                mesh->initRange(modelRanges[i]);
+
+        int index32 = 0;
+        for (int i = 0; i < level->roomsCount; i++)
+            index32 |= roomRanges[i].geometry.index32 | roomRanges[i].sprites.index32;
+        for (int i = 0; i < level->spriteSequencesCount; i++)
+            index32 |= spriteSequences[i].index32;
+        for (int i = 0; i < mCount; i++)
+            index32 |= meshInfo[i].index32;
+        for (int i = 0; i < level->modelsCount; i++)
+            index32 |= modelRanges[i].index32;
+        if (index32 && !Core::support.index32) {
+            LOG("! mesh: 32-bit indices are not supported\n");
+        }
     }
 
-    ~MeshBuilder() {
-        delete[] animTexRanges;
-        delete[] animTexOffsets;
-        delete[] roomRanges;
-        delete[] meshInfo;
-        delete[] meshMap;
-        delete[] spriteSequences;
-        delete mesh;
+// baked cache
+    struct Info {
+        int iCount, vCount, aCount, mCount, buffersCount;
+        int animTexRangesCount, animTexOffsetsCount;
+        int bakeStatic;
+    };
+
+    template <typename T>
+    T* copy(const T *data, int count) {
+        T *a = new T[count];
+        memcpy(a, data, count * sizeof(T));
+        return a;
+    }
+
+    bool load(const Cache &cache) {
+        ASSERT(!roomRanges);
+        const Info *info = cache.get<Info>(Cache::MESH_INFO, 1);
+        if (!info || info->bakeStatic != (int)bakeStatic) return false;
+
+        const Index      *cIndices  = cache.get<Index>(Cache::MESH_INDICES, info->iCount);
+        const MeshVertex *cVertices = cache.get<MeshVertex>(Cache::MESH_VERTICES, info->vCount);
+        const RoomRange  *cRooms    = cache.get<RoomRange>(Cache::MESH_ROOMS, level->roomsCount);
+        const MeshInfo   *cObjects  = cache.get<MeshInfo>(Cache::MESH_OBJECTS, info->mCount);
+        const int        *cMap      = cache.get<int>(Cache::MESH_MAP, level->meshOffsetsCount);
+        const MeshRange  *cSprites  = cache.get<MeshRange>(Cache::MESH_SPRITES, level->spriteSequencesCount);
+        const MeshRange  *cShadow   = cache.get<MeshRange>(Cache::MESH_SHADOW, 1);
+        const vec2       *cRanges   = cache.get<vec2>(Cache::MESH_ANIM_RANGES, info->animTexRangesCount);
+        const vec2       *cOffsets  = cache.get<vec2>(Cache::MESH_ANIM_OFFSETS, info->animTexOffsetsCount);
+        const MeshBuffer *cBuffers  = cache.get<MeshBuffer>(Cache::MESH_BUFFERS, info->buffersCount);
+        const MeshRange  *cModels   = cache.get<MeshRange>(Cache::MESH_MODELS, level->modelsCount);
+
+        if (!cIndices || !cVertices || !cRooms || !cObjects || (level->meshOffsetsCount && !cMap) || (level->spriteSequencesCount && !cSprites) || !cShadow || !cRanges || !cOffsets || !cBuffers || (level->modelsCount && !cModels))
+            return false;
+
+        for (int i = 0; i < level->meshOffsetsCount; i++)
+            if (cMap[i] < -1 || cMap[i] >= info->mCount)
+                return false;
+
+        iCount   = info->iCount;
+        vCount   = info->vCount;
+        aCount   = info->aCount;
+        mCount   = info->mCount;
+        indices  = (Index*)cIndices;
+        vertices = (Vertex*)cVertices;
+
+        roomRanges      = copy(cRooms, level->roomsCount);
+        meshInfo        = copy(cObjects, mCount);
+        spriteSequences = copy(cSprites, level->spriteSequencesCount);
+        shadowBlob      = *cShadow;
+        buffersCount    = info->buffersCount;
+        buffers         = copy(cBuffers, buffersCount);
+        modelRanges     = copy(cModels, level->modelsCount);
+        initSkinMap();
+
+        meshMap = new MeshInfo*[level->meshOffsetsCount];
+        for (int i = 0; i < level->meshOffsetsCount; i++)
+            meshMap[i] = cMap[i] > -1 ? &meshInfo[cMap[i]] : NULL;
+
+        animTexRangesCount  = info->animTexRangesCount;
+        animTexOffsetsCount = info->animTexOffsetsCount;
+        animTexRanges       = copy(cRanges, animTexRangesCount);
+        animTexOffsets      = copy(cOffsets, animTexOffsetsCount);
+        return baked = true;
+    }
+
+    void save(Cache &cache) {
+        Info info = { iCount, vCount, aCount, mCount, buffersCount, animTexRangesCount, animTexOffsetsCount, bakeStatic };
+
+        int *map = new int[level->meshOffsetsCount];
+        for (int i = 0; i < level->meshOffsetsCount; i++)
+            map[i] = meshMap[i] ? int(meshMap[i] - meshInfo) : -1;
+
+        cache.put(Cache::MESH_INFO,         &info,           sizeof(info));
+        cache.put(Cache::MESH_INDICES,      indices,         iCount * sizeof(Index));
+        cache.put(Cache::MESH_VERTICES,     vertices,        vCount * sizeof(MeshVertex));
+        cache.put(Cache::MESH_ROOMS,        roomRanges,      level->roomsCount * sizeof(RoomRange));
+        cache.put(Cache::MESH_OBJECTS,      meshInfo,        mCount * sizeof(MeshInfo));
+        cache.put(Cache::MESH_MAP,          map,             level->meshOffsetsCount * sizeof(int));
+        cache.put(Cache::MESH_SPRITES,      spriteSequences, level->spriteSequencesCount * sizeof(MeshRange));
+        cache.put(Cache::MESH_SHADOW,       &shadowBlob,     sizeof(shadowBlob));
+        cache.put(Cache::MESH_ANIM_RANGES,  animTexRanges,   animTexRangesCount * sizeof(vec2));
+        cache.put(Cache::MESH_ANIM_OFFSETS, animTexOffsets,  animTexOffsetsCount * sizeof(vec2));
+        cache.put(Cache::MESH_BUFFERS,      buffers,         buffersCount * sizeof(MeshBuffer));
+        cache.put(Cache::MESH_MODELS,       modelRanges,     level->modelsCount * sizeof(MeshRange));
+
+        delete[] map;
     }
 
     vec2 getTexCoord(const TR::ObjectTexture &tex) {
-        int  tile = tex.tile.index;
-        int  tx = (tile % 4) * 256;
-        int  ty = (tile / 4) * 256;
-        return vec2( (float)(((tx + tex.vertices[0].Xpixel) << 5) + 16),
-                     (float)(((ty + tex.vertices[0].Ypixel) << 5) + 16) );
+        short2 t = layout->getTexCoord(&tex, 0);
+        return vec2((float)t.x, (float)t.y);
     }
 
     void initAnimTextures(TR::Level &level) {
@@ -566,11 +1520,31 @@ struct MeshBuilder {
         animTexOffsets[0] = vec2(0.0f);
         animTexOffsetsCount = 1;
 
+        animTexMap = new AnimTexFrame[level.objectTexturesCount];
+        for (int i = 0; i < level.objectTexturesCount; i++) {
+            AnimTexFrame &f = animTexMap[i];
+            f.texture = i;
+            f.range   = f.frame = 0;
+            f.alpha   = layout->objectAlpha[i];
+        }
+
         ptr = &level.animTexturesData[1];
         for (int i = 1; i < animTexRangesCount; i++) {
-            int start = animTexOffsetsCount;
             TR::AnimTexture *animTex = (TR::AnimTexture*)ptr;
 
+            bool alpha = false;
+            for (int j = 0; j <= animTex->count; j++)
+                alpha |= layout->objectAlpha[animTex->textures[j]];
+
+            for (int j = 0; j <= animTex->count; j++) {
+                AnimTexFrame &f = animTexMap[animTex->textures[j]];
+                f.alpha |= alpha;
+                if (f.range) continue; // texture of several ranges, the first one wins
+                f.texture = animTex->textures[0];
+                f.range   = i;
+                f.frame   = j;
+            }
+
             vec2 first = getTexCoord(level.objectTextures[animTex->textures[0]]);
             animTexOffsets[animTexOffsetsCount++] = vec2(0.0f); // first - first for first frame %)
 
@@ -581,47 +1555,37 @@ struct MeshBuilder {
         }
     }
 
+// object textures which are not in the level (dummy) are not animated
     TR::ObjectTexture* getAnimTexture(TR::ObjectTexture *tex, int &range, int &frame) {
         range = frame = 0;
-        if (!level->animTexturesDataSize)
+        int i = int(tex - level->objectTextures);
+        if (!animTexMap || i < 0 || i >= level->objectTexturesCount)
             return tex;
 
-        uint16 *ptr = &level->animTexturesData[1];
-        for (int i = 1; i < animTexRangesCount; i++) {
-            TR::AnimTexture *animTex = (TR::AnimTexture*)ptr;
+        const AnimTexFrame &f = animTexMap[i];
+        range = f.range;
+        frame = f.frame;
+        return &level->objectTextures[f.texture];
+    }
 
-            for (int j = 0; j <= animTex->count; j++)
-                if (tex == &level->objectTextures[animTex->textures[j]]) {
-                    range = i;
-                    frame = j;
-                    return &level->objectTextures[animTex->textures[0]];
-                }
-            
-            ptr += (sizeof(TR::AnimTexture) + sizeof(animTex->textures[0]) * (animTex->count + 1)) / sizeof(uint16);
-        }
-        
-        return tex;
+// faces with transparent texels (of any animation frame) are alpha tested, dummy textures are opaque
+    bool isAlphaTested(TR::ObjectTexture *tex) {
+        int i = int(tex - level->objectTextures);
+        return animTexMap && i >= 0 && i < level->objectTexturesCount && animTexMap[i].alpha;
     }
 
     void addTexCoord(Vertex *vertices, int vCount, TR::ObjectTexture *tex) {
         int range, frame;
         tex = getAnimTexture(tex, range, frame);
 
-        int  tile = tex->tile.index;
-        int  tx = (tile % 4) * 256;
-        int  ty = (tile / 4) * 256;
-
         int count = tex->tile.triangle ? 3 : 4;
         for (int i = 0; i < count; i++) {
-            Vertex &v = vertices[vCount + i];
-            v.texCoord.x = ((tx + tex->vertices[i].Xpixel) << 5) + 16;
-            v.texCoord.y = ((ty + tex->vertices[i].Ypixel) << 5) + 16;
-            v.texCoord.z = range;
-            v.texCoord.w = frame;
+            short2 t = layout->getTexCoord(tex, i);
+            vertices[vCount + i].texCoord = { t.x, t.y, int16(range), int16(frame) };
         }
     }
 
-    void addTriangle(Index *indices, int &iCount, int vCount, int vStart, Vertex *vertices, TR::ObjectTexture *tex) {
+    void addTriangle(uint32 *indices, int &iCount, int vCount, int vStart, Vertex *vertices, TR::ObjectTexture *tex) {
         int  vIndex = vCount - vStart;
 
         indices[iCount + 0] = vIndex + 0;
@@ -630,10 +1594,13 @@ struct MeshBuilder {
 
         iCount += 3;
 
-        if (tex) addTexCoord(vertices, vCount, tex);
+        if (tex) {
+            addTexCoord(vertices, vCount, tex);
+            faceAlpha[iCount / 3 - 1] = isAlphaTested(tex);
+        }
     }
 
-    void addQuad(Index *indices, int &iCount, int vCount, int vStart, Vertex *vertices, TR::ObjectTexture *tex) {
+    void addQuad(uint32 *indices, int &iCount, int vCount, int vStart, Vertex *vertices, TR::ObjectTexture *tex) {
         int  vIndex = vCount - vStart;
 
         indices[iCount + 0] = vIndex + 0;
@@ -646,10 +1613,13 @@ struct MeshBuilder {
 
         iCount += 6;
 
-        if (tex) addTexCoord(vertices, vCount, tex);
+        if (tex) {
+            addTexCoord(vertices, vCount, tex);
+            faceAlpha[iCount / 3 - 2] = faceAlpha[iCount / 3 - 1] = isAlphaTested(tex);
+        }
     }
 
-    void addSprite(Index *indices, Vertex *vertices, int &iCount, int &vCount, int vStart, int16 x, int16 y, int16 z, const TR::SpriteTexture &sprite, uint8 intensity) {
+    void addSprite(uint32 *indices, Vertex *vertices, int &iCount, int &vCount, int vStart, int16 x, int16 y, int16 z, const TR::SpriteTexture &sprite, uint8 intensity) {
         addQuad(indices, iCount, vCount, vStart, NULL, NULL);
 
         Vertex *quad = &vertices[vCount];
@@ -658,13 +1628,11 @@ struct MeshBuilder {
         quad[0].normal = quad[1].normal = quad[2].normal = quad[3].normal = { 0, 0, 0, 0 };
         quad[0].color  = quad[1].color  = quad[2].color  = quad[3].color  = { 255, 255, 255, intensity };
 
-        int  tx = (sprite.tile % 4) * 256;
-        int  ty = (sprite.tile / 4) * 256;
-
-        int16 u0 = ((tx + sprite.u) << 5) + 16;
-        int16 v0 = ((ty + sprite.v) << 5) + 16;
-        int16 u1 = u0 + (sprite.w >> 3);
-        int16 v1 = v0 + (sprite.h >> 3);
+        short2 t = layout->getTexCoord(&sprite);
+        int16 u0 = t.x;
+        int16 v0 = t.y;
+        int16 u1 = u0 + ((sprite.w * (32768 / layout->width))  >> 8);
+        int16 v1 = v0 + ((sprite.h * (32768 / layout->height)) >> 8);
 
         quad[0].texCoord = { u0, v0, sprite.r, sprite.t };
         quad[1].texCoord = { u1, v0, sprite.l, sprite.t };
@@ -678,18 +1646,6 @@ struct MeshBuilder {
         mesh->bind();
     }
 
-    void renderRoomGeometry(int roomIndex) {
-        mesh->render(roomRanges[roomIndex].geometry);
-    }
-
-    void renderRoomSprites(int roomIndex) {
-        mesh->render(roomRanges[roomIndex].sprites);
-    }
-
-    bool hasRoomSprites(int roomIndex) {
-        return roomRanges[roomIndex].sprites.iCount > 0;
-    }
-
     void renderMesh(MeshInfo *meshInfo) {
         mesh->render(*meshInfo);
     }
@@ -698,11 +1654,27 @@ struct MeshBuilder {
         renderMesh(&meshInfo[meshIndex]);
     }
 
-    void renderSprite(int sequenceIndex, int frame) {
+    MeshRange getSprite(int sequenceIndex, int frame) {
         MeshRange range = spriteSequences[sequenceIndex];
         range.iCount  = 6;
-        range.iStart += frame * 6;
-        mesh->render(range);
+        range.iStart += frame * 6 * (range.index32 ? 2 : 1);
+        return range;
+    }
+
+    void renderSprite(int sequenceIndex, int frame) {
+        mesh->render(getSprite(sequenceIndex, frame));
+    }
+
+// skinned model that has the mesh as joint, -1 if none
+    int getSkin(int meshIndex, int joint) {
+        int start = meshIndex - joint;
+        if (start < 0 || start >= level->meshOffsetsCount) return -1;
+        int model = skinMap[start];
+        return (model > -1 && level->models[model].mCount > joint) ? model : -1;
+    }
+
+    void renderModel(int modelIndex) {
+        mesh->render(modelRanges[modelIndex]);
     }
 
     void renderShadowSpot() {
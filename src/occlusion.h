@@ -0,0 +1,320 @@
+#ifndef H_OCCLUSION
+#define H_OCCLUSION
+
+#include "format.h"
+#include "atlas.h"
+#include "cache.h"
+
+#define OCCLUSION_WIDTH     256
+#define OCCLUSION_HEIGHT    128
+#define OCCLUSION_BANDS     8           // horizontal bands of the depth buffer rasterized independently (by worker threads)
+#define OCCLUSION_THREADS   0           // bands are rasterized by the thread pool, 0 - all CPUs
+#define OCCLUSION_MIN_AREA  65536.0f    // min area of room triangle to be occluder (half of 1024x256 quad)
+#define OCCLUSION_NEAR      1.0f        // min w of tested box (box crossing the camera plane is visible)
+
+// software occlusion culling: low resolution depth buffer of large opaque room faces of visible rooms,
+// boxes of static meshes & entities are tested against it before submission
+// occluder fills only fully covered pixels with its farthest depth in the pixel, so the test is conservative
+struct Occlusion {
+
+    struct Vertex { // in pixels, iw = 1/w
+        float x, y, iw;
+    };
+
+    struct Setup {  // screen space triangle
+        float A[3], B[3], C[3];     // edge functions at pixel center, positive inside (biased by half pixel for full coverage)
+        float dzdx, dzdy, dz;       // plane of the farthest 1/w in the pixel
+        int   x0, y0, x1, y1;       // bounds in pixels
+    };
+
+    const TR::Level *level;
+
+    vec3  *triangles;       // occluders in world space
+    int   trianglesCount;
+    int   *roomTriangles;   // index of the first occluder by room (roomsCount + 1)
+
+    Setup *setups;          // triangles of the last render (near plane clipping makes up to 2 of an occluder)
+    int   setupsCount;
+    int   bandPixels[OCCLUSION_BANDS];
+
+    float *depth;           // 1/w of the nearest occluder by pixel, 0 if none
+    mat4  viewProj;
+
+    int   trianglesDrawn;   // counters of the last frame
+    int   pixelsDrawn;      // fully covered by occluders (with overdraw)
+
+    Occlusion(const TR::Level &level) : level(&level), triangles(NULL), trianglesCount(0), setups(NULL), setupsCount(0), trianglesDrawn(0), pixelsDrawn(0) {
+        roomTriangles = new int[level.roomsCount + 1];
+        memset(roomTriangles, 0, (level.roomsCount + 1) * sizeof(int));
+        depth = new float[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+        memset(depth, 0, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float));
+    }
+
+    ~Occlusion() {
+        delete[] triangles;
+        delete[] setups;
+        delete[] roomTriangles;
+        delete[] depth;
+    }
+
+    bool load(const Cache &cache) {
+        const int *cRooms = cache.get<int>(Cache::OCCLUSION_ROOMS, level->roomsCount + 1);
+        if (!cRooms) return false;
+        const vec3 *cTriangles = cache.get<vec3>(Cache::OCCLUSION_TRIANGLES, cRooms[level->roomsCount] * 3);
+        if (!cTriangles && cRooms[level->roomsCount]) return false;
+
+        trianglesCount = cRooms[level->roomsCount];
+        triangles = new vec3[trianglesCount * 3];
+        setups    = new Setup[trianglesCount * 2];
+        memcpy(roomTriangles, cRooms, (level->roomsCount + 1) * sizeof(int));
+        memcpy(triangles, cTriangles, trianglesCount * 3 * sizeof(vec3));
+        return true;
+    }
+
+    void save(Cache &cache) {
+        cache.put(Cache::OCCLUSION_ROOMS,     roomTriangles, (level->roomsCount + 1) * sizeof(int));
+        cache.put(Cache::OCCLUSION_TRIANGLES, triangles,     trianglesCount * 3 * sizeof(vec3));
+    }
+
+// large room faces with opaque textures (animated textures can change transparency, skipped)
+    void build(const Atlas::Layout &layout) {
+        const TR::Level &level = *this->level;
+
+        bool *opaque = new bool[level.objectTexturesCount];
+        for (int i = 0; i < level.objectTexturesCount; i++)
+            opaque[i] = !level.objectTextures[i].attribute && !layout.objectAlpha[i];
+
+        if (level.animTexturesDataSize) {
+            uint16 *ptr = &level.animTexturesData[0];
+            int count = *ptr++;
+            for (int i = 0; i < count; i++) {
+                TR::AnimTexture *animTex = (TR::AnimTexture*)ptr;
+                for (int j = 0; j <= animTex->count; j++)
+                    opaque[animTex->textures[j]] = false;
+                ptr += (sizeof(TR::AnimTexture) + sizeof(animTex->textures[0]) * (animTex->count + 1)) / sizeof(uint16);
+            }
+        }
+
+        int count = 0;
+        for (int i = 0; i < level.roomsCount; i++)
+            count += level.rooms[i].data.rCount * 2 + level.rooms[i].data.tCount;
+
+        delete[] triangles;
+        delete[] setups;
+        triangles = new vec3[count * 3];
+        setups    = new Setup[count * 2];
+        trianglesCount = 0;
+
+        for (int i = 0; i < level.roomsCount; i++) {
+            const TR::Room::Data &d = level.rooms[i].data;
+            vec3 offset = vec3(level.rooms[i].info.x, 0.0f, level.rooms[i].info.z);
+            roomTriangles[i] = trianglesCount;
+
+            for (int j = 0; j < d.rCount; j++) {
+                const TR::Rectangle &f = d.rectangles[j];
+                if (!opaque[f.texture]) continue;
+                addTriangle(offset, d, f.vertices[0], f.vertices[1], f.vertices[2]);
+                addTriangle(offset, d, f.vertices[0], f.vertices[2], f.vertices[3]);
+            }
+
+            for (int j = 0; j < d.tCount; j++) {
+                const TR::Triangle &f = d.triangles[j];
+                if (!opaque[f.texture]) continue;
+                addTriangle(offset, d, f.vertices[0], f.vertices[1], f.vertices[2]);
+            }
+        }
+        roomTriangles[level.roomsCount] = trianglesCount;
+
+        delete[] opaque;
+        LOG("occlusion: %d of %d room triangles are occluders\n", trianglesCount, count);
+    }
+
+    void addTriangle(const vec3 &offset, const TR::Room::Data &d, int i0, int i1, int i2) {
+        vec3 a = offset + d.vertices[i0].vertex;
+        vec3 b = offset + d.vertices[i1].vertex;
+        vec3 c = offset + d.vertices[i2].vertex;
+        if ((b - a).cross(c - a).length() * 0.5f < OCCLUSION_MIN_AREA)
+            return;
+        vec3 *t = &triangles[trianglesCount++ * 3];
+        t[0] = a;
+        t[1] = b;
+        t[2] = c;
+    }
+
+    Vertex project(const vec4 &p) const {
+        Vertex v;
+        v.iw = 1.0f / p.w;
+        v.x  = (p.x * v.iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        v.y  = (p.y * v.iw * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        return v;
+    }
+
+// edge functions & depth plane of the triangle, returns false if it covers no pixel
+    bool setup(const Vertex &p0, const Vertex &p1, const Vertex &p2, Setup &t) const {
+        float area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+        if (fabsf(area) < EPS) return false;
+
+        const Vertex *v[3] = { &p0, &p1, &p2 };
+        if (area < 0.0f) {
+            swap(v[1], v[2]);
+            area = -area;
+        }
+
+        t.x0 = max(0, int(floorf(min(min(p0.x, p1.x), p2.x))));
+        t.y0 = max(0, int(floorf(min(min(p0.y, p1.y), p2.y))));
+        t.x1 = min(OCCLUSION_WIDTH,  int(ceilf(max(max(p0.x, p1.x), p2.x))));
+        t.y1 = min(OCCLUSION_HEIGHT, int(ceilf(max(max(p0.y, p1.y), p2.y))));
+        if (t.x0 >= t.x1 || t.y0 >= t.y1) return false;
+
+        for (int i = 0; i < 3; i++) {
+            const Vertex &a = *v[i], &b = *v[(i + 1) % 3];
+            t.A[i] = a.y - b.y;
+            t.B[i] = b.x - a.x;
+            t.C[i] = -(t.A[i] * a.x + t.B[i] * a.y) - (fabsf(t.A[i]) + fabsf(t.B[i])) * 0.5f;
+        }
+
+        vec3 d1 = vec3(v[1]->x - v[0]->x, v[1]->y - v[0]->y, v[1]->iw - v[0]->iw);
+        vec3 d2 = vec3(v[2]->x - v[0]->x, v[2]->y - v[0]->y, v[2]->iw - v[0]->iw);
+        t.dzdx = (d1.z * d2.y - d2.z * d1.y) / area;
+        t.dzdy = (d2.z * d1.x - d1.z * d2.x) / area;
+        t.dz   = v[0]->iw - t.dzdx * v[0]->x - t.dzdy * v[0]->y - (fabsf(t.dzdx) + fabsf(t.dzdy)) * 0.5f;
+        return true;
+    }
+
+// row[k] = max(row[k], z + k * dzdx) for k in [k0, k1]
+    static void fillSpan(float *row, int k0, int k1, float z, float dzdx) {
+        int k = k0;
+    #if defined(__AVX2__)
+        __m256 vz = _mm256_add_ps(_mm256_set1_ps(z), _mm256_mul_ps(_mm256_set1_ps(dzdx), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+        __m256 vk = _mm256_set1_ps(float(k));
+        __m256 vd = _mm256_set1_ps(dzdx);
+        for (; k + 8 <= k1 + 1; k += 8) {
+            __m256 d = _mm256_add_ps(vz, _mm256_mul_ps(vk, vd));
+            _mm256_storeu_ps(row + k, _mm256_max_ps(_mm256_loadu_ps(row + k), d));
+            vk = _mm256_add_ps(vk, _mm256_set1_ps(8.0f));
+        }
+    #elif defined(SIMD_SSE2)
+        __m128 vz = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(_mm_set1_ps(dzdx), _mm_setr_ps(0, 1, 2, 3)));
+        __m128 vk = _mm_set1_ps(float(k));
+        __m128 vd = _mm_set1_ps(dzdx);
+        for (; k + 4 <= k1 + 1; k += 4) {
+            __m128 d = _mm_add_ps(vz, _mm_mul_ps(vk, vd));
+            _mm_storeu_ps(row + k, _mm_max_ps(_mm_loadu_ps(row + k), d));
+            vk = _mm_add_ps(vk, _mm_set1_ps(4.0f));
+        }
+    #endif
+        for (; k <= k1; k++)
+            row[k] = max(row[k], z + k * dzdx);
+    }
+
+// fill pixels of the rows fully covered by the triangle with 1/w of its farthest point in the pixel, returns pixels count
+    int rasterize(const Setup &t, int y0, int y1) {
+        int pixels = 0;
+    // span of fully covered pixels of the row by edges crossing it
+        for (int y = max(y0, t.y0); y < min(y1, t.y1); y++) {
+            float cx = t.x0 + 0.5f, cy = y + 0.5f;
+            int   k0 = 0, k1 = t.x1 - t.x0 - 1;
+            for (int i = 0; i < 3 && k0 <= k1; i++) {
+                float e = t.A[i] * cx + t.B[i] * cy + t.C[i];
+                if (t.A[i] > 0.0f)
+                    k0 = max(k0, int(min(ceilf(-e / t.A[i]), float(OCCLUSION_WIDTH))));
+                else if (t.A[i] < 0.0f)
+                    k1 = min(k1, int(max(floorf(-e / t.A[i]), -1.0f)));
+                else if (e < 0.0f)
+                    k1 = -1;
+            }
+            if (k0 > k1) continue;
+
+            fillSpan(depth + y * OCCLUSION_WIDTH + t.x0, k0, k1, t.dzdx * cx + t.dzdy * cy + t.dz, t.dzdx);
+            pixels += k1 - k0 + 1;
+        }
+        return pixels;
+    }
+
+// triangles are binned by bands of rows, every band is filled by a single thread
+    static void rasterizeBandProc(void *arg, int index) {
+        Occlusion *occlusion = (Occlusion*)arg;
+        int y0 = index * OCCLUSION_HEIGHT / OCCLUSION_BANDS;
+        int y1 = (index + 1) * OCCLUSION_HEIGHT / OCCLUSION_BANDS;
+        int pixels = 0;
+        for (int i = 0; i < occlusion->setupsCount; i++) {
+            const Setup &t = occlusion->setups[i];
+            if (t.y0 < y1 && t.y1 > y0)
+                pixels += occlusion->rasterize(t, y0, y1);
+        }
+        occlusion->bandPixels[index] = pixels;
+    }
+
+// draw occluders of the rooms, front faces only (clipped by near plane)
+    void render(const int *rooms, int roomsCount, const mat4 &viewProj, const vec3 &viewPos, int threads = OCCLUSION_THREADS) {
+        this->viewProj = viewProj;
+        memset(depth, 0, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float));
+        trianglesDrawn = pixelsDrawn = setupsCount = 0;
+
+        for (int r = 0; r < roomsCount; r++)
+            for (int i = roomTriangles[rooms[r]]; i < roomTriangles[rooms[r] + 1]; i++) {
+                const vec3 *t = &triangles[i * 3];
+                if ((t[0] - t[2]).cross(t[0] - t[1]).dot(viewPos - t[0]) <= 0.0f) // back face (normal as in room geometry)
+                    continue;
+
+                vec4 clip[3];
+                for (int j = 0; j < 3; j++)
+                    clip[j] = viewProj * vec4(t[j], 1.0f);
+
+                Vertex poly[4];
+                int count = 0;
+                for (int j = 0; j < 3; j++) {
+                    const vec4 &a = clip[j];
+                    const vec4 &b = clip[(j + 1) % 3];
+                    float da = a.z + a.w, db = b.z + b.w; // distance to near plane (z >= -w)
+                    if (da >= 0.0f)
+                        poly[count++] = project(a);
+                    if ((da >= 0.0f) != (db >= 0.0f)) {
+                        float k = da / (da - db);
+                        poly[count++] = project(vec4(a.x + (b.x - a.x) * k, a.y + (b.y - a.y) * k, a.z + (b.z - a.z) * k, a.w + (b.w - a.w) * k));
+                    }
+                }
+                if (count < 3) continue;
+
+                for (int j = 2; j < count; j++)
+                    if (setup(poly[0], poly[j - 1], poly[j], setups[setupsCount]))
+                        setupsCount++;
+                trianglesDrawn++;
+            }
+
+        Thread::parallelFor(OCCLUSION_BANDS, rasterizeBandProc, this, threads);
+        for (int i = 0; i < OCCLUSION_BANDS; i++)
+            pixelsDrawn += bandPixels[i];
+    }
+
+// box is not hidden by occluders of the last render
+    bool isVisible(const vec3 &min, const vec3 &max) const {
+        float x0 = +FLT_MAX, y0 = +FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX, iw = 0.0f;
+        for (int i = 0; i < 8; i++) {
+            vec4 p = viewProj * vec4((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z, 1.0f);
+            if (p.w < OCCLUSION_NEAR)
+                return true;
+            Vertex v = project(p);
+            x0 = ::min(x0, v.x);
+            y0 = ::min(y0, v.y);
+            x1 = ::max(x1, v.x);
+            y1 = ::max(y1, v.y);
+            iw = ::max(iw, v.iw);
+        }
+
+        int ix0 = ::max(0, int(floorf(x0)));
+        int iy0 = ::max(0, int(floorf(y0)));
+        int ix1 = ::min(OCCLUSION_WIDTH,  int(ceilf(x1)));
+        int iy1 = ::min(OCCLUSION_HEIGHT, int(ceilf(y1)));
+
+        for (int y = iy0; y < iy1; y++) {
+            const float *row = depth + y * OCCLUSION_WIDTH;
+            for (int x = ix0; x < ix1; x++)
+                if (row[x] < iw)
+                    return true;
+        }
+        return ix0 >= ix1 || iy0 >= iy1; // out of the screen, left to frustum culling
+    }
+};
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef H_OPTIMIZER
+#define H_OPTIMIZER
+
+#include "utils.h"
+
+#define OPT_CACHE_SIZE  32  // LRU cache size of index reordering
+#define OPT_FIFO_SIZE   16  // FIFO cache size of ACMR estimation
+
+// indexed triangle lists optimization for post-transform vertex cache & vertex fetch (thread safe, no GL calls)
+namespace Optimizer {
+
+// transformed vertices count for FIFO cache (ACMR = misses / triangles)
+    template <typename I>
+    int getCacheMisses(const I *indices, int iCount, int cacheSize = OPT_FIFO_SIZE) {
+        int cache[OPT_CACHE_SIZE];
+        ASSERT(cacheSize > 0 && cacheSize <= OPT_CACHE_SIZE);
+        cacheSize = clamp(cacheSize, 1, OPT_CACHE_SIZE);
+        int head = 0, count = 0, misses = 0;
+        for (int i = 0; i < iCount; i++) {
+            int index = int(indices[i]);
+            int j = 0;
+            while (j < count && cache[j] != index) j++;
+            if (j < count) continue;
+            misses++;
+            cache[head] = index;
+            head = (head + 1) % cacheSize;
+            count = min(count + 1, cacheSize);
+        }
+        return misses;
+    }
+
+// merge equal vertices, returns new vertices count
+    template <typename V, typename I>
+    int weld(V *vertices, int vCount, I *indices, int iCount) {
+        int size = 1;
+        while (size < vCount * 2)
+            size <<= 1;
+        int *table = new int[size];
+        int *remap = new int[vCount];
+        memset(table, -1, size * sizeof(int));
+
+        int count = 0;
+        for (int i = 0; i < vCount; i++) {
+            uint32 h = fnv32(&vertices[i], sizeof(V)) & (size - 1);
+            while (table[h] != -1 && memcmp(&vertices[table[h]], &vertices[i], sizeof(V)))
+                h = (h + 1) & (size - 1);
+            if (table[h] == -1) {
+                table[h] = count;
+                vertices[count++] = vertices[i]; // in place, count <= i
+            }
+            remap[i] = table[h];
+        }
+
+        for (int i = 0; i < iCount; i++)
+            indices[i] = I(remap[indices[i]]);
+
+        delete[] remap;
+        delete[] table;
+        return count;
+    }
+
+    float getVertexScore(int cachePos, int remaining) {
+        if (!remaining)
+            return -1.0f;
+        float score = 0.0f;
+        if (cachePos >= 3)
+            score = powf(1.0f - (cachePos - 3) * (1.0f / (OPT_CACHE_SIZE - 3)), 1.5f);
+        else if (cachePos >= 0)
+            score = 0.75f; // vertices of the last triangle
+        return score + 2.0f / sqrtf((float)remaining); // favor vertices with few triangles left
+    }
+
+// greedy triangles reordering for LRU cache (Tom Forsyth's "Linear-Speed Vertex Cache Optimisation")
+    template <typename I>
+    void reorderIndices(I *indices, int iCount, int vCount) {
+        int tCount = iCount / 3;
+        if (tCount < 2) return;
+
+        int   *offset    = new int[vCount + 1];
+        int   *remaining = new int[vCount];
+        int   *cachePos  = new int[vCount];
+        float *vScore    = new float[vCount];
+        int   *vTris     = new int[iCount];
+        float *tScore    = new float[tCount];
+        bool  *added     = new bool[tCount];
+        I     *result    = new I[iCount];
+
+    // vertex -> triangles adjacency
+        memset(remaining, 0, vCount * sizeof(int));
+        for (int i = 0; i < iCount; i++)
+            remaining[indices[i]]++;
+        offset[0] = 0;
+        for (int i = 0; i < vCount; i++) {
+            offset[i + 1] = offset[i] + remaining[i];
+            remaining[i]  = 0;
+        }
+        for (int i = 0; i < iCount; i++) {
+            int v = indices[i];
+            vTris[offset[v] + remaining[v]++] = i / 3;
+        }
+
+        for (int i = 0; i < vCount; i++) {
+            cachePos[i] = -1;
+            vScore[i]   = getVertexScore(-1, remaining[i]);
+        }
+        for (int i = 0; i < tCount; i++) {
+            const I *t = indices + i * 3;
+            tScore[i] = vScore[t[0]] + vScore[t[1]] + vScore[t[2]];
+            added[i]  = false;
+        }
+
+        int cache[OPT_CACHE_SIZE + 3];
+        int cacheCount = 0;
+        int best = -1;
+
+        for (int n = 0; n < tCount; n++) {
+            if (best < 0) { // no candidates in cache, find the best of the rest
+                float bestScore = -FLT_MAX;
+                for (int i = 0; i < tCount; i++)
+                    if (!added[i] && tScore[i] > bestScore) {
+                        bestScore = tScore[i];
+                        best = i;
+                    }
+            }
+
+            const I *t = indices + best * 3;
+            memcpy(result + n * 3, t, 3 * sizeof(I));
+            added[best] = true;
+
+        // remove triangle from adjacency of its vertices
+            for (int k = 0; k < 3; k++) {
+                int v = t[k];
+                int *tris = vTris + offset[v];
+                for (int j = 0; j < remaining[v]; j++)
+                    if (tris[j] == best) {
+                        tris[j] = tris[--remaining[v]];
+                        break;
+                    }
+            }
+
+        // move triangle vertices to the top of the cache
+            int newCache[OPT_CACHE_SIZE + 3];
+            int newCount = 0;
+            for (int k = 0; k < 3; k++)
+                newCache[newCount++] = t[k];
+            for (int i = 0; i < cacheCount; i++)
+                if (cache[i] != int(t[0]) && cache[i] != int(t[1]) && cache[i] != int(t[2]))
+                    newCache[newCount++] = cache[i];
+
+            for (int i = 0; i < newCount; i++) {
+                int v = newCache[i];
+                cachePos[v] = i < OPT_CACHE_SIZE ? i : -1;
+                vScore[v]   = getVertexScore(cachePos[v], remaining[v]);
+            }
+
+        // rescore triangles of vertices in cache (including evicted ones)
+            best = -1;
+            float bestScore = -FLT_MAX;
+            for (int i = 0; i < newCount; i++) {
+                int v = newCache[i];
+                int *tris = vTris + offset[v];
+                for (int j = 0; j < remaining[v]; j++) {
+                    const I *tt = indices + tris[j] * 3;
+                    float score = vScore[tt[0]] + vScore[tt[1]] + vScore[tt[2]];
+                    tScore[tris[j]] = score;
+                    if (score > bestScore) {
+                        bestScore = score;
+                        best = tris[j];
+                    }
+                }
+            }
+
+            cacheCount = min(newCount, OPT_CACHE_SIZE);
+            memcpy(cache, newCache, cacheCount * sizeof(int));
+        }
+
+        memcpy(indices, result, tCount * 3 * sizeof(I));
+
+        delete[] result;
+        delete[] added;
+        delete[] tScore;
+        delete[] vTris;
+        delete[] vScore;
+        delete[] cachePos;
+        delete[] remaining;
+        delete[] offset;
+    }
+
+// vertices in order of the first use by indices (unreferenced are removed), returns new vertices count
+    template <typename V, typename I>
+    int reorderVertices(V *vertices, int vCount, I *indices, int iCount) {
+        int *remap = new int[vCount];
+        V   *data  = new V[vCount];
+        memset(remap, -1, vCount * sizeof(int));
+
+        int count = 0;
+        for (int i = 0; i < iCount; i++) {
+            int v = indices[i];
+            if (remap[v] == -1) {
+                remap[v] = count;
+                data[count++] = vertices[v];
+            }
+            indices[i] = I(remap[v]);
+        }
+        memcpy(vertices, data, count * sizeof(V));
+
+        delete[] data;
+        delete[] remap;
+        return count;
+    }
+
+// weld, reorder for vertex cache & fetch (triangles don't cross iSplit), returns new vertices count
+    template <typename V, typename I>
+    int optimize(V *vertices, int vCount, I *indices, int iCount, int iSplit = 0) {
+        if (!iCount) return vCount;
+        vCount = weld(vertices, vCount, indices, iCount);
+        reorderIndices(indices, iSplit, vCount);
+        reorderIndices(indices + iSplit, iCount - iSplit, vCount);
+        return reorderVertices(vertices, vCount, indices, iCount);
+    }
+}
+
+#endif
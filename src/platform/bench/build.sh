@@ -0,0 +1 @@
+clang++ -std=c++11 -O2 -fno-exceptions -fno-rtti -DNDEBUG main.cpp ../../libs/stb_vorbis/stb_vorbis.c -I../../ -o../../../bin/bench -lGL -lX11 -lm -lpthread
@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <new>
+
+#include "format.h"
+#include "atlas.h"
+#include "mesh.h"
+#include "portals.h"
+#include "occlusion.h"
+
+// headless level loading benchmark (no window or GL context)
+// usage: bench [level file] [iterations] [stream buffer size] [cold]
+// cold - drop the level file from page cache before each load
+
+double getTime() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+// count heap allocations
+int allocCount;
+
+void* operator new(size_t size) {
+    allocCount++;
+    return malloc(size);
+}
+
+void* operator new[](size_t size) {
+    allocCount++;
+    return malloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+long getRSS() {
+    long pages = 0;
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    fscanf(f, "%*d %ld", &pages);
+    fclose(f);
+#endif
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+struct IOStats {
+    long long calls, bytes; // read syscalls & bytes read by the process
+
+    IOStats() : calls(0), bytes(0) {
+    #ifdef __linux__
+        FILE *f = fopen("/proc/self/io", "r");
+        if (!f) return;
+        char line[64];
+        long long value;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "syscr: %lld", &value) == 1) calls = value;
+            if (sscanf(line, "rchar: %lld", &value) == 1) bytes = value;
+        }
+        fclose(f);
+    #endif
+    }
+};
+
+void dropCache(const char *name) {
+#ifdef __linux__
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#endif
+}
+
+void benchLoad(const char *title, const char *name, int count, bool map, int bufferSize, bool cold) {
+    double time = 0.0;
+    IOStats s;
+    for (int i = 0; i < count; i++) {
+        if (cold) dropCache(name);
+        double t = getTime();
+        Stream stream(name, map, bufferSize);
+        TR::Level *level = new TR::Level(stream, true);
+        delete level;
+        time += getTime() - t;
+    }
+    IOStats e;
+    printf("%-20s: %8.3f ms  %8.1f syscalls  %10.0f bytes\n", title, time / count, double(e.calls - s.calls) / count, double(e.bytes - s.bytes) / count);
+}
+
+void benchMemory(const char *title, const char *name, bool map) {
+    Stream stream(name, map);
+    long rss   = getRSS();
+    int  count = allocCount;
+    TR::Level *level = new TR::Level(stream, true);
+    printf("%-20s: %8d allocs  %8ld KB RSS\n", title, allocCount - count, (getRSS() - rss) / 1024);
+    delete level;
+}
+
+// reference per-texel palette expansion into 1024x1024 atlas
+void expandReference(const TR::Level &level, TR::RGBA *data) {
+    for (int i = 0; i < level.tilesCount; i++) {
+        int tx = (i % 4) * 256;
+        int ty = (i / 4) * 256;
+
+        TR::RGBA *ptr = &data[ty * 1024 + tx];
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                int index = level.tiles[i].index[y * 256 + x];
+                auto p = level.palette[index];
+                ptr[x].r = p.r;
+                ptr[x].g = p.g;
+                ptr[x].b = p.b;
+                ptr[x].a = index == 0 ? 0 : 255;
+            }
+            ptr += 1024;
+        }
+    }
+}
+
+void benchAtlas(const char *name, int count) {
+    Stream stream(name, true);
+    TR::Level level(stream, true);
+
+    double time = getTime();
+    Atlas::Layout *layout;
+    for (int i = 0; i < count; i++) {
+        layout = new Atlas::Layout(level);
+        if (i < count - 1) delete layout;
+    }
+    double timeLayout = (getTime() - time) / count;
+
+    TR::RGBA *data   = new TR::RGBA[1024 * 1024];
+    TR::RGBA *packed = new TR::RGBA[Atlas::getDataSize(layout->width, layout->height)];
+
+    time = getTime();
+    for (int i = 0; i < count; i++)
+        expandReference(level, data);
+    double timeRef = (getTime() - time) / count;
+
+    time = getTime();
+    for (int i = 0; i < count; i++)
+        Atlas::build(*layout, packed, 1, 1);
+    double timeLUT = (getTime() - time) / count;
+
+    time = getTime();
+    for (int i = 0; i < count; i++)
+        Atlas::build(*layout, packed, 0, 1);
+    double timeMT = (getTime() - time) / count;
+
+    time = getTime();
+    for (int i = 0; i < count; i++)
+        Atlas::build(*layout, packed);
+    double timeMips = (getTime() - time) / count;
+
+    uint8 *compressed = new uint8[Atlas::getCompressedSize(layout->width, layout->height)];
+    int dxtCount = max(1, count / 10);
+    time = getTime();
+    for (int i = 0; i < dxtCount; i++)
+        Atlas::compress(packed, layout->width, layout->height, compressed, 1);
+    double timeDXT = (getTime() - time) / dxtCount;
+
+    time = getTime();
+    for (int i = 0; i < dxtCount; i++)
+        Atlas::compress(packed, layout->width, layout->height, compressed);
+    double timeDXTMT = (getTime() - time) / dxtCount;
+
+    int alphaErrors;
+    float psnr = Atlas::getPSNR(packed, compressed, layout->width, layout->height, alphaErrors);
+
+// every texel of packed rects must match the source tiles
+    int diff = 0;
+    for (int i = 0; i < layout->rectsCount; i++) {
+        const Atlas::Layout::Rect &r = layout->rects[i];
+        if (r.tile < 0) continue;
+        for (int y = 0; y < r.h; y++)
+            for (int x = 0; x < r.w; x++) {
+                TR::RGBA &a = packed[(r.dy + y) * layout->width + r.dx + x];
+                TR::RGBA &b = data[((r.tile / 4) * 256 + r.y + y) * 1024 + (r.tile % 4) * 256 + r.x + x];
+                diff += memcmp(&a, &b, sizeof(a)) != 0;
+            }
+    }
+
+    int used = layout->getUsedArea();
+    printf("atlas layout        : %8.3f ms  %dx%d, %d regions, packing ratio %.1f%%, %.1f%% of 1024x1024, %.1f%% of %d tiles referenced\n", timeLayout,
+           layout->width, layout->height, layout->rectsCount, used * 100.0f / (layout->width * layout->height), layout->width * layout->height * 100.0f / (1024 * 1024), used * 100.0f / (level.tilesCount * 256 * 256), level.tilesCount);
+    printf("atlas (reference)   : %8.3f ms\n", timeRef);
+    printf("atlas (lut)         : %8.3f ms\n", timeLUT);
+    printf("atlas (lut, %2d thr) : %8.3f ms  (%d texels differ)\n", min(Thread::getCPUCount(), layout->rectsCount), timeMT, diff);
+    printf("atlas (%d mips)      : %8.3f ms  %d KB\n", ATLAS_MIPS, timeMips, Atlas::getDataSize(layout->width, layout->height) * 4 / 1024);
+    printf("atlas (dxt1)        : %8.3f ms  %d KB, PSNR %.2f dB, %d texels changed transparency\n", timeDXT, Atlas::getCompressedSize(layout->width, layout->height) / 1024, psnr, alphaErrors);
+    printf("atlas (dxt1, %2d thr): %8.3f ms\n", Thread::getCPUCount(), timeDXTMT);
+
+    delete layout;
+    delete[] compressed;
+    delete[] packed;
+    delete[] data;
+}
+
+bool equalRange(const MeshRange &a, const MeshRange &b) {
+    return a.iStart == b.iStart && a.iCount == b.iCount && a.vStart == b.vStart && a.buffer == b.buffer && a.index32 == b.index32 && a.iOpaque == b.iOpaque;
+}
+
+void benchMesh(const char *name, int count) {
+    Stream stream(name, true);
+    TR::Level level(stream, true);
+    Atlas::Layout layout(level);
+
+    for (int opt = 0; opt < 2; opt++) {
+        double time = getTime();
+        MeshBuilder *mesh;
+        for (int i = 0; i < count; i++) {
+            mesh = new MeshBuilder(level);
+            mesh->build(layout, opt != 0);
+            if (i < count - 1) delete mesh;
+        }
+        time = (getTime() - time) / count;
+
+        printf("%-20s: %8.3f ms  %d vertices, %d indices, ACMR %.3f (FIFO %d)\n", opt ? "mesh (optimized)" : "mesh", time, mesh->vCount, mesh->iCount,
+               (float)mesh->optStats.misses[1] / max(1, mesh->optStats.tCount), OPT_FIFO_SIZE);
+        printf("%-20s: anim %.3f, count %.3f, map %.3f, fill %.3f, compact %.3f ms (last build)\n", "  phases", mesh->buildTime.animTex, mesh->buildTime.count,
+               mesh->buildTime.meshMap, mesh->buildTime.fill, mesh->buildTime.compact);
+        delete mesh;
+    }
+
+// parallel fill pass must produce the same output as serial one
+    double time[2];
+    MeshBuilder *mesh[2];
+    for (int t = 0; t < 2; t++) {
+        time[t] = getTime();
+        for (int i = 0; i < count; i++) {
+            mesh[t] = new MeshBuilder(level);
+            mesh[t]->build(layout, true, t ? 0 : 1);
+            if (i < count - 1) delete mesh[t];
+        }
+        time[t] = (getTime() - time[t]) / count;
+    }
+
+    MeshBuilder &a = *mesh[0], &b = *mesh[1];
+    bool equal = a.iCount == b.iCount && a.vCount == b.vCount &&
+                 !memcmp(a.indices,  b.indices,  a.iCount * sizeof(Index)) &&
+                 !memcmp(a.vertices, b.vertices, a.vCount * sizeof(Vertex));
+    for (int i = 0; i < level.roomsCount; i++)
+        equal &= equalRange(a.roomRanges[i].geometry, b.roomRanges[i].geometry) && equalRange(a.roomRanges[i].sprites, b.roomRanges[i].sprites);
+    for (int i = 0; i < a.mCount; i++)
+        equal &= equalRange(a.meshInfo[i], b.meshInfo[i]);
+    for (int i = 0; i < level.spriteSequencesCount; i++)
+        equal &= equalRange(a.spriteSequences[i], b.spriteSequences[i]);
+    for (int i = 0; i < level.modelsCount; i++)
+        equal &= equalRange(a.modelRanges[i], b.modelRanges[i]);
+
+    printf("mesh (%2d thr)       : %8.3f ms  speedup x%.2f, output %s\n", Thread::getCPUCount(), time[1], time[0] / time[1], equal ? "identical" : "DIFFERS");
+
+// faces drawn without alpha test
+    int tOpaque = 0, tCount = 0;
+    for (int i = 0; i < level.roomsCount; i++) {
+        tOpaque += a.roomRanges[i].geometry.iOpaque / 3;
+        tCount  += a.roomRanges[i].geometry.iCount / 3;
+    }
+    for (int i = 0; i < a.mCount; i++) {
+        tOpaque += a.meshInfo[i].iOpaque / 3;
+        tCount  += a.meshInfo[i].iCount / 3;
+    }
+    printf("%-20s: %d of %d faces (%.1f%%) without transparent texels\n", "  opaque", tOpaque, tCount, tOpaque * 100.0f / max(1, tCount));
+    delete mesh[0];
+    delete mesh[1];
+}
+
+// draw calls of rooms & their static meshes per view (as Level::queueRoom) without & with static meshes baked into room geometry
+void benchStatics(const char *name) {
+    Stream stream(name, true);
+    TR::Level level(stream, true);
+    Atlas::Layout layout(level);
+    Portals portals(level);
+    MeshBuilder *mesh[2];
+    int baked = 0, total = 0;
+    for (int i = 0; i < 2; i++) {
+        mesh[i] = new MeshBuilder(level);
+        mesh[i]->bakeStatic = i != 0;
+        mesh[i]->build(layout);
+    }
+    for (int i = 0; i < level.roomsCount; i++)
+        for (int j = 0; j < level.rooms[i].meshesCount; j++) {
+            baked += mesh[1]->getBakedMesh(i, level.rooms[i].meshes[j]) != NULL;
+            total++;
+        }
+
+    mat4 mProj = mat4(80.0f, 16.0f / 9.0f, 128.0f, 100.0f * 1024.0f);
+    int views = 0, draws[2] = { 0, 0 }, tris[2] = { 0, 0 }, worst[2] = { 0, 0 };
+
+    for (int r = 0; r < level.roomsCount; r++) {
+        const TR::Room &room = level.rooms[r];
+        vec3 pos = vec3(room.info.x + room.xSectors * 512.0f, (room.info.yTop + room.info.yBottom) * 0.5f, room.info.z + room.zSectors * 512.0f);
+
+        for (int d = 0; d < 8; d++) {
+            float a = d * PI * 0.25f;
+            mat4 mViewInv = mat4(pos, pos + vec3(sinf(a), 0.0f, cosf(a)), vec3(0, -1, 0));
+            mat4 mViewProj = mProj * mViewInv.inverse();
+
+            portals.traverse(r, mViewProj, pos);
+
+            int viewDraws[2] = { 0, 0 };
+            for (int m = 0; m < 2; m++)
+                for (int i = 0; i < portals.visibleCount; i++) {
+                    int index = portals.visible[i];
+                    const TR::Room &vRoom = level.rooms[index];
+                    const MeshBuilder::RoomRange &range = mesh[m]->roomRanges[index];
+                    viewDraws[m] += (range.geometry.iOpaque > 0) + (range.geometry.iCount > range.geometry.iOpaque) + (range.sprites.iCount > 0);
+                    tris[m] += range.geometry.iCount / 3;
+
+                    Frustum frustum;
+                    portals.getFrustum(index, mViewProj, pos, frustum);
+                    for (int j = 0; j < vRoom.meshesCount; j++) {
+                        const TR::Room::Mesh &rMesh = vRoom.meshes[j];
+                        if (mesh[m]->getBakedMesh(index, rMesh)) continue;
+                        TR::StaticMesh *sMesh = level.getMeshByID(rMesh.meshID);
+                        Box box;
+                        sMesh->getBox(false, rMesh.rotation, box);
+                        vec3 offset = vec3(rMesh.x, rMesh.y, rMesh.z);
+                        if (!frustum.isVisible(offset + box.min, offset + box.max))
+                            continue;
+                        viewDraws[m]++;
+                        tris[m] += mesh[m]->meshMap[sMesh->mesh] ? mesh[m]->meshMap[sMesh->mesh]->iCount / 3 : 0;
+                    }
+                }
+
+            draws[0] += viewDraws[0];
+            draws[1] += viewDraws[1];
+            if (viewDraws[0] - viewDraws[1] > worst[0] - worst[1]) {
+                worst[0] = viewDraws[0];
+                worst[1] = viewDraws[1];
+            }
+            views++;
+        }
+    }
+
+    printf("statics (baked)     : %d of %d meshes, draws %.1f -> %.1f, triangles %.0f -> %.0f per view, best view %d -> %d\n", baked, total,
+           float(draws[0]) / views, float(draws[1]) / views, float(tris[0]) / views, float(tris[1]) / views, worst[0], worst[1]);
+    delete mesh[0];
+    delete mesh[1];
+}
+
+// vertex layouts: size & normal precision of compact one
+void benchVertex(const char *name, int count) {
+    Stream stream(name, true);
+    TR::Level level(stream, true);
+    Atlas::Layout layout(level);
+    MeshBuilder mesh(level);
+    mesh.build(layout);
+
+    VertexCompact *packed = new VertexCompact[mesh.vCount];
+    double time = getTime();
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < mesh.vCount; j++)
+            packed[j] = VertexCompact::pack(mesh.vertices[j], false);
+    time = (getTime() - time) / count;
+
+    float maxError = 0.0f, sumError = 0.0f;
+    int   nCount   = 0;
+    for (int i = 0; i < mesh.vCount; i++) {
+        const short4 &n = mesh.vertices[i].normal;
+        if (!(n.x | n.y | n.z)) continue;
+    // decode octahedral normal (as in the shader)
+        vec3 d(packed[i].normal.x / 32767.0f, packed[i].normal.y / 32767.0f, 0.0f);
+        d.z = 1.0f - fabsf(d.x) - fabsf(d.y);
+        if (d.z < 0.0f) {
+            float x = d.x;
+            d.x = (1.0f - fabsf(d.y)) * (d.x >= 0.0f ? 1.0f : -1.0f);
+            d.y = (1.0f - fabsf(x))   * (d.y >= 0.0f ? 1.0f : -1.0f);
+        }
+        float e = acosf(clamp(d.normal().dot(vec3(n.x, n.y, n.z).normal()), -1.0f, 1.0f)) * RAD2DEG;
+        maxError  = max(maxError, e);
+        sumError += e;
+        nCount++;
+    }
+
+    printf("vertex (%d bytes)   : %8d KB\n", (int)sizeof(Vertex), int(mesh.vCount * sizeof(Vertex) / 1024));
+    printf("vertex (%d bytes)   : %8d KB  pack %.3f ms, normal error avg %.4f, max %.4f deg\n", (int)sizeof(VertexCompact), int(mesh.vCount * sizeof(VertexCompact) / 1024),
+           time, sumError / max(1, nCount), maxError);
+    delete[] packed;
+}
+
+// recursive portal traversal (reference), every portal path is walked separately
+struct PortalsRecursive {
+    const TR::Level &level;
+    bool *visible;
+    int  roomsVisited, portalsClipped;
+
+    PortalsRecursive(const TR::Level &level) : level(level) {
+        visible = new bool[level.roomsCount];
+    }
+
+    ~PortalsRecursive() {
+        delete[] visible;
+    }
+
+    void walk(int roomIndex, int from, const Frustum &camFrustum) {
+        if (roomsVisited >= 1000000) return; // path explosion guard
+        roomsVisited++;
+        visible[roomIndex] = true;
+
+        const TR::Room &room = level.rooms[roomIndex];
+        vec3 offset = vec3(room.info.x, 0.0f, room.info.z);
+
+        Frustum frustum;
+        for (int i = 0; i < room.portalsCount; i++) {
+            const TR::Room::Portal &p = room.portals[i];
+            if (p.roomIndex == from) continue;
+
+            vec3 v[] = {
+                offset + p.vertices[0],
+                offset + p.vertices[1],
+                offset + p.vertices[2],
+                offset + p.vertices[3],
+            };
+
+            frustum = camFrustum;
+            portalsClipped++;
+            if (frustum.clipByPortal(v, 4, p.normal))
+                walk(p.roomIndex, roomIndex, frustum);
+        }
+    }
+
+    void traverse(int roomIndex, const mat4 &viewProj, const vec3 &viewPos) {
+        memset(visible, 0, level.roomsCount);
+        roomsVisited = portalsClipped = 0;
+        Frustum frustum;
+        frustum.pos = viewPos;
+        frustum.calcPlanes(viewProj);
+        walk(roomIndex, -1, frustum);
+    }
+};
+
+// portal traversal: recursive vs breadth-first with merged portal rects (without & with PVS) for views from every room center in 8 directions
+void benchPortals(const char *name, int count) {
+    Stream stream(name, true);
+    TR::Level level(stream, true);
+    PortalsRecursive ref(level);
+    Portals portals(level);
+    Portals bounded(level);
+
+    double timePVS = getTime();
+    bounded.buildPVS();
+    timePVS = getTime() - timePVS;
+
+    int pvsSum = 0;
+    for (int i = 0; i < level.roomsCount; i++)
+        for (int j = 0; j < level.roomsCount; j++)
+            pvsSum += bounded.isPossiblyVisible(i, j);
+
+    bool *found = new bool[level.roomsCount];
+    mat4 mProj = mat4(80.0f, 16.0f / 9.0f, 128.0f, 100.0f * 1024.0f);
+
+    double timeRef = 0.0, time = 0.0, timeBounded = 0.0;
+    int  sumRef[2] = { 0, 0 }, sum[2] = { 0, 0 }, sumBounded[2] = { 0, 0 }, visRef = 0, vis = 0, views = 0, missed = 0, missedPVS = 0;
+    int  worstRoom = 0, worstDir = 0, worstRef[2] = { 0, 0 }, worst[2] = { 0, 0 };
+
+    for (int r = 0; r < level.roomsCount; r++) {
+        const TR::Room &room = level.rooms[r];
+        vec3 pos = vec3(room.info.x + room.xSectors * 512.0f, (room.info.yTop + room.info.yBottom) * 0.5f, room.info.z + room.zSectors * 512.0f);
+
+        for (int d = 0; d < 8; d++) {
+            float a = d * PI * 0.25f;
+            mat4 mViewInv = mat4(pos, pos + vec3(sinf(a), 0.0f, cosf(a)), vec3(0, -1, 0));
+            mat4 mViewProj = mProj * mViewInv.inverse();
+
+            double t = getTime();
+            for (int i = 0; i < count; i++)
+                ref.traverse(r, mViewProj, pos);
+            timeRef += getTime() - t;
+
+            t = getTime();
+            for (int i = 0; i < count; i++)
+                portals.traverse(r, mViewProj, pos);
+            time += getTime() - t;
+
+            t = getTime();
+            for (int i = 0; i < count; i++)
+                bounded.traverse(r, mViewProj, pos);
+            timeBounded += getTime() - t;
+
+            sumRef[0] += ref.roomsVisited;
+            sumRef[1] += ref.portalsClipped;
+            sum[0]    += portals.roomsVisited;
+            sum[1]    += portals.portalsClipped;
+            sumBounded[0] += bounded.roomsVisited;
+            sumBounded[1] += bounded.portalsClipped;
+            views++;
+
+        // visible set must be a superset of the reference one (rects are conservative)
+            memset(found, 0, level.roomsCount);
+            for (int i = 0; i < portals.visibleCount; i++)
+                found[portals.visible[i]] = true;
+            for (int i = 0; i < level.roomsCount; i++) {
+                visRef += ref.visible[i];
+                vis    += found[i];
+                if (ref.visible[i] && !found[i])
+                    missed++;
+                if ((ref.visible[i] || found[i]) && !bounded.isPossiblyVisible(r, i))
+                    missedPVS++;
+            }
+
+            if (ref.portalsClipped > worstRef[1]) {
+                worstRoom   = r;
+                worstDir    = d;
+                worstRef[0] = ref.roomsVisited;
+                worstRef[1] = ref.portalsClipped;
+                worst[0]    = portals.roomsVisited;
+                worst[1]    = portals.portalsClipped;
+            }
+        }
+    }
+    delete[] found;
+
+    printf("portals (recursive) : %8.2f us  rooms %.1f, portals %.1f, visible %.1f per view\n", timeRef * 1000.0 / (views * count),
+           float(sumRef[0]) / views, float(sumRef[1]) / views, float(visRef) / views);
+    printf("portals (merged)    : %8.2f us  rooms %.1f, portals %.1f, visible %.1f per view, missed %d\n", time * 1000.0 / (views * count),
+           float(sum[0]) / views, float(sum[1]) / views, float(vis) / views, missed);
+    printf("portals (PVS)       : %8.2f us  rooms %.1f, portals %.1f per view, missed %d\n", timeBounded * 1000.0 / (views * count),
+           float(sumBounded[0]) / views, float(sumBounded[1]) / views, missedPVS);
+    printf("portals (PVS build) : %8.2f ms  %.1f of %d rooms per room\n", timePVS, float(pvsSum) / max(1, int(level.roomsCount)), level.roomsCount);
+    printf("portals (worst view): room %d dir %d  rooms %d -> %d, portals %d -> %d\n", worstRoom, worstDir,
+           worstRef[0], worst[0], worstRef[1], worst[1]);
+}
+
+// occlusion culling of static meshes for views from every room center in 8 directions (after portal frustum culling)
+void benchOcclusion(const char *name, int count) {
+    Stream stream(name, true);
+    TR::Level level(stream, true);
+    Atlas::Layout layout(level);
+    MeshBuilder mesh(level);
+    mesh.build(layout);
+    Portals portals(level);
+    Occlusion occlusion(level);
+
+    double time = getTime();
+    occlusion.build(layout);
+    double timeBuild = getTime() - time;
+
+    mat4 mProj = mat4(80.0f, 16.0f / 9.0f, 128.0f, 100.0f * 1024.0f);
+
+    float *depth = new float[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+    double timeRender = 0.0, timeThreads = 0.0, timeTest = 0.0;
+    int views = 0, tris = 0, pixels = 0, meshes[2] = { 0, 0 }, meshTris[2] = { 0, 0 }, threadsDiffer = 0;
+    int worstRoom = 0, worstDir = 0, worstTris[2] = { 0, 0 }, worstMeshes[2] = { 0, 0 };
+
+    for (int r = 0; r < level.roomsCount; r++) {
+        const TR::Room &room = level.rooms[r];
+        vec3 pos = vec3(room.info.x + room.xSectors * 512.0f, (room.info.yTop + room.info.yBottom) * 0.5f, room.info.z + room.zSectors * 512.0f);
+
+        for (int d = 0; d < 8; d++) {
+            float a = d * PI * 0.25f;
+            mat4 mViewInv = mat4(pos, pos + vec3(sinf(a), 0.0f, cosf(a)), vec3(0, -1, 0));
+            mat4 mViewProj = mProj * mViewInv.inverse();
+
+            portals.traverse(r, mViewProj, pos);
+
+            double t = getTime();
+            for (int i = 0; i < count; i++)
+                occlusion.render(portals.visible, portals.visibleCount, mViewProj, pos);
+            timeRender += getTime() - t;
+            memcpy(depth, occlusion.depth, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float));
+
+            t = getTime();
+            for (int i = 0; i < count; i++)
+                occlusion.render(portals.visible, portals.visibleCount, mViewProj, pos, 0);
+            timeThreads += getTime() - t;
+            if (memcmp(depth, occlusion.depth, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float)))
+                threadsDiffer++;
+
+            tris   += occlusion.trianglesDrawn;
+            pixels += occlusion.pixelsDrawn;
+            views++;
+
+            int viewMeshes[2] = { 0, 0 }, viewTris[2] = { 0, 0 };
+            t = getTime();
+            for (int i = 0; i < portals.visibleCount; i++) {
+                const TR::Room &vRoom = level.rooms[portals.visible[i]];
+                Frustum frustum;
+                portals.getFrustum(portals.visible[i], mViewProj, pos, frustum);
+
+                for (int j = 0; j < vRoom.meshesCount; j++) {
+                    const TR::Room::Mesh &rMesh = vRoom.meshes[j];
+                    TR::StaticMesh *sMesh = level.getMeshByID(rMesh.meshID);
+                    Box box;
+                    sMesh->getBox(false, rMesh.rotation, box);
+                    vec3 offset = vec3(rMesh.x, rMesh.y, rMesh.z);
+                    if (!frustum.isVisible(offset + box.min, offset + box.max))
+                        continue;
+                    int mTris = mesh.meshMap[sMesh->mesh] ? mesh.meshMap[sMesh->mesh]->iCount / 3 : 0;
+                    viewMeshes[0]++;
+                    viewTris[0] += mTris;
+                    if (occlusion.isVisible(offset + box.min, offset + box.max))
+                        continue;
+                    viewMeshes[1]++;
+                    viewTris[1] += mTris;
+                }
+            }
+            timeTest += getTime() - t;
+
+            meshes[0]   += viewMeshes[0];
+            meshes[1]   += viewMeshes[1];
+            meshTris[0] += viewTris[0];
+            meshTris[1] += viewTris[1];
+            if (viewTris[1] > worstTris[1]) {
+                worstRoom = r;
+                worstDir  = d;
+                worstTris[0]   = viewTris[0];
+                worstTris[1]   = viewTris[1];
+                worstMeshes[0] = viewMeshes[0];
+                worstMeshes[1] = viewMeshes[1];
+            }
+        }
+    }
+
+    printf("occlusion (build)   : %8.2f ms  %d occluders\n", timeBuild, occlusion.trianglesCount);
+    printf("occlusion (render)  : %8.2f us  %.1f occluders, %.0f pixels of %dx%d per view\n", timeRender * 1000.0 / (views * count),
+           float(tris) / views, float(pixels) / views, OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+    printf("occlusion (%2d thr)  : %8.2f us  %d views differ from 1 thread\n", Thread::getCPUCount(), timeThreads * 1000.0 / (views * count), threadsDiffer);
+    printf("occlusion (statics) : %8.2f us  culled %d of %d meshes, %d of %d triangles\n", timeTest * 1000.0 / views,
+           meshes[1], meshes[0], meshTris[1], meshTris[0]);
+    printf("occlusion (best view): room %d dir %d  culled %d of %d meshes, %d of %d triangles\n", worstRoom, worstDir,
+           worstMeshes[1], worstMeshes[0], worstTris[1], worstTris[0]);
+    delete[] depth;
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : "LEVEL2_DEMO.PHD";
+    int count      = argc > 2 ? atoi(argv[2]) : 100;
+    int bufferSize = argc > 3 ? atoi(argv[3]) : STREAM_BUFFER_SIZE;
+    bool cold      = argc > 4 && !strcmp(argv[4], "cold");
+
+    printf("level: %s x %d (%s page cache)\n", name, count, cold ? "cold" : "warm");
+
+    benchMemory("memory (copy)", name, false);
+    benchMemory("memory (mapped)", name, true);
+
+    char title[32];
+    sprintf(title, "load (buffer %d)", bufferSize);
+    benchLoad("load (unbuffered)", name, count, false, 0, cold);
+    benchLoad(title, name, count, false, bufferSize, cold);
+    benchLoad("load (mapped)", name, count, true, 0, cold);
+
+    benchAtlas(name, count);
+    benchMesh(name, count);
+    benchStatics(name);
+    benchVertex(name, count);
+    benchPortals(name, max(1, count / 10));
+    benchOcclusion(name, max(1, count / 10));
+    return 0;
+}
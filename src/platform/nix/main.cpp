@@ -181,8 +181,7 @@ int main() {
             pthread_mutex_unlock(&sndMutex);
             lastTime = time;
 
-            Core::stats.dips = 0;
-            Core::stats.tris = 0;
+            Core::resetStats();
             Game::render();
             glXSwapBuffers(dpy, wnd);
 
@@ -220,8 +220,7 @@ int main() {
             }
             lastTime = time;
 
-            Core::stats.dips = 0;
-            Core::stats.tris = 0;
+            Core::resetStats();
             Game::render();
             aglSwapBuffers(context);
 
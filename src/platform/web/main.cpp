@@ -97,8 +97,7 @@ void main_loop() {
     }
     lastTime = time;
     
-    Core::stats.dips = 0;
-    Core::stats.tris = 0;
+    Core::resetStats();
     Game::render();
     eglSwapBuffers(display, surface);
 
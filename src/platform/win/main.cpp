@@ -323,8 +323,7 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
             LeaveCriticalSection(&sndCS);
             lastTime = time;
 
-            Core::stats.dips = 0;
-            Core::stats.tris = 0;
+            Core::resetStats();
             Game::render();
             SwapBuffers(hDC);
 
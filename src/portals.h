@@ -0,0 +1,332 @@
+#ifndef H_PORTALS
+#define H_PORTALS
+
+#include "format.h"
+#include "frustum.h"
+#include "cache.h"
+#include "thread.h"
+
+#define PORTALS_MAX_VISITS 4     // room is processed again while its rect grows, the last visit takes the whole view rect
+#define PORTALS_RECT_EPS   0.002f // rect expansion (in NDC) to keep portals seen edge-on
+#define PORTALS_PVS_EPS    256.0f // margin of PVS plane tests (camera can be slightly out of its room box)
+
+// breadth-first portal traversal of visible rooms, screen rects of portals leading to the room are merged
+// (room is processed a bounded number of times instead of once per portal path), bounded by PVS of the camera room
+struct Portals {
+
+    struct Rect {   // in NDC, empty if x0 >= x1 or y0 >= y1
+        float x0, y0, x1, y1;
+
+        bool isEmpty() const {
+            return x0 >= x1 || y0 >= y1;
+        }
+
+    // returns true if the rect grows
+        bool merge(const Rect &r) {
+            if (isEmpty()) {
+                *this = r;
+                return true;
+            }
+            if (r.x0 >= x0 && r.y0 >= y0 && r.x1 <= x1 && r.y1 <= y1)
+                return false;
+            x0 = min(x0, r.x0);
+            y0 = min(y0, r.y0);
+            x1 = max(x1, r.x1);
+            y1 = max(y1, r.y1);
+            return true;
+        }
+    };
+
+    const TR::Level *level;
+
+    Rect  *rects;       // visible screen rect by room
+    uint8 *visits;      // processing count by room
+    bool  *queued;
+    int   *queue;       // ring buffer of rooms to process
+    int   *visible;     // visible rooms in order of the first reach
+    int   visibleCount;
+
+    int   roomsVisited;     // counters of the last traversal
+    int   portalsClipped;
+
+    uint32 *pvs;        // potentially visible set, bit matrix of rooms (row by room of the camera), NULL if not built
+    int    pvsStride;   // row size in uint32
+    double pvsTime;     // build time in ms
+
+    Portals(const TR::Level &level) : level(&level), visibleCount(0), roomsVisited(0), portalsClipped(0), pvs(NULL), pvsStride((level.roomsCount + 31) / 32), pvsTime(0.0) {
+        rects   = new Rect[level.roomsCount];
+        visits  = new uint8[level.roomsCount];
+        queued  = new bool[level.roomsCount];
+        queue   = new int[level.roomsCount];
+        visible = new int[level.roomsCount];
+    }
+
+    ~Portals() {
+        delete[] rects;
+        delete[] visits;
+        delete[] queued;
+        delete[] queue;
+        delete[] visible;
+        delete[] pvs;
+    }
+
+    bool isPossiblyVisible(int from, int to) const {
+        return !pvs || ((pvs[from * pvsStride + (to >> 5)] >> (to & 31)) & 1);
+    }
+
+    bool load(const Cache &cache) {
+        const uint32 *data = cache.get<uint32>(Cache::PORTALS_PVS, level->roomsCount * pvsStride);
+        if (!data) return false;
+        pvs = new uint32[level->roomsCount * pvsStride];
+        memcpy(pvs, data, level->roomsCount * pvsStride * sizeof(uint32));
+        return true;
+    }
+
+    void save(Cache &cache) {
+        cache.put(Cache::PORTALS_PVS, pvs, level->roomsCount * pvsStride * sizeof(uint32));
+    }
+
+    struct Plane {  // portal in world space
+        vec3 vertices[4];
+        vec3  n;    // points into the room of the portal
+        float d;
+        int   room; // room behind the portal
+
+        float dist(const vec3 &p) const {
+            return n.dot(p) + d;
+        }
+
+    // any vertex behind the plane of portal p
+        bool isBehind(const Plane &p) const {
+            for (int i = 0; i < 4; i++)
+                if (p.dist(vertices[i]) < PORTALS_PVS_EPS)
+                    return true;
+            return false;
+        }
+
+    // any corner of the box in front of the plane
+        bool isFacing(const vec3 &min, const vec3 &max) const {
+            for (int i = 0; i < 8; i++)
+                if (dist(vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z)) > -PORTALS_PVS_EPS)
+                    return true;
+            return false;
+        }
+    };
+
+// rooms visible from anywhere in the room (conservative)
+// a sight line crosses portals of the chain in order, so the next portal has a point behind the planes of the first & the entry portals
+// and faces the box of the room. Portal is expanded at most once per first portal: its next portals depend on the first portal & itself only,
+// so visited flags (reset per first portal) don't lose any room. Flip map rooms are added with their pair
+    void buildPVS() {
+        const TR::Level &level = *this->level;
+        double time = Thread::getTime();
+
+        int *first = new int[level.roomsCount + 1]; // index of the first portal by room
+        first[0] = 0;
+        for (int i = 0; i < level.roomsCount; i++)
+            first[i + 1] = first[i] + level.rooms[i].portalsCount;
+        int count = first[level.roomsCount];
+
+        Plane *planes = new Plane[count];
+        for (int i = 0; i < level.roomsCount; i++) {
+            const TR::Room &room = level.rooms[i];
+            vec3 offset = vec3(room.info.x, 0.0f, room.info.z);
+            for (int j = 0; j < room.portalsCount; j++) {
+                const TR::Room::Portal &p = room.portals[j];
+                Plane &plane = planes[first[i] + j];
+                for (int k = 0; k < 4; k++)
+                    plane.vertices[k] = offset + p.vertices[k];
+                plane.n = vec3(p.normal).normal();
+                plane.d = -plane.n.dot(plane.vertices[0]);
+                plane.room = p.roomIndex;
+            }
+        }
+
+        bool *visited = new bool[count];
+        int  *stack   = new int[count];
+
+        delete[] pvs;
+        pvs = new uint32[level.roomsCount * pvsStride];
+        memset(pvs, 0, level.roomsCount * pvsStride * sizeof(uint32));
+
+        for (int r = 0; r < level.roomsCount; r++) {
+            const TR::Room &room = level.rooms[r];
+            uint32 *row = pvs + r * pvsStride;
+            vec3 min = vec3(room.info.x, room.info.yTop, room.info.z);
+            vec3 max = vec3(room.info.x + room.xSectors * 1024.0f, room.info.yBottom, room.info.z + room.zSectors * 1024.0f);
+
+            row[r >> 5] |= 1 << (r & 31);
+
+            for (int s = first[r]; s < first[r + 1]; s++) {
+                memset(visited, 0, count);
+                visited[s] = true;
+                stack[0] = s;
+                int sp = 1;
+
+                while (sp) {
+                    const Plane &e = planes[stack[--sp]];
+                    row[e.room >> 5] |= 1 << (e.room & 31);
+
+                    for (int i = first[e.room]; i < first[e.room + 1]; i++) {
+                        const Plane &q = planes[i];
+                        if (visited[i] || !q.isBehind(planes[s]) || !q.isBehind(e) || !q.isFacing(min, max))
+                            continue;
+                        visited[i] = true;
+                        stack[sp++] = i;
+                    }
+                }
+            }
+        }
+
+    // flip map rooms replace each other in place
+        for (int r = 0; r < level.roomsCount; r++) {
+            uint32 *row = pvs + r * pvsStride;
+            for (int i = 0; i < level.roomsCount; i++) {
+                int alt = level.rooms[i].alternateRoom;
+                if (alt >= 0 && ((row[i >> 5] >> (i & 31)) & 1))
+                    row[alt >> 5] |= 1 << (alt & 31);
+            }
+        }
+
+        delete[] first;
+        delete[] planes;
+        delete[] visited;
+        delete[] stack;
+
+        pvsTime = Thread::getTime() - time;
+        int sum = 0;
+        for (int i = 0; i < level.roomsCount * pvsStride; i++)
+            for (uint32 bits = pvs[i]; bits; bits &= bits - 1)
+                sum++;
+        LOG("portals: PVS %.1f of %d rooms, built in %.1f ms\n", float(sum) / max(1, int(level.roomsCount)), level.roomsCount, pvsTime);
+    }
+
+// screen rect of portal polygon clipped by eye plane & the rect of the room it is seen from
+// (not by near plane, portal closer than znear still leads to the visible room behind it)
+    static bool getRect(const vec3 *vertices, int vCount, const mat4 &viewProj, const Rect &view, Rect &rect) {
+        vec4 clip[4];
+        for (int i = 0; i < vCount; i++)
+            clip[i] = viewProj * vec4(vertices[i], 1.0f);
+
+        rect.x0 = rect.y0 = +FLT_MAX;
+        rect.x1 = rect.y1 = -FLT_MAX;
+        int count = 0;
+        for (int i = 0; i < vCount; i++) {
+            const vec4 &a = clip[i];
+            const vec4 &b = clip[(i + 1) % vCount];
+            float da = a.w, db = b.w; // distance to eye plane (w >= 0)
+
+            vec4 p[2];
+            int  n = 0;
+            if (da >= 0.0f)
+                p[n++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f)) {
+                float t = da / (da - db);
+                p[n++] = vec4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+            }
+
+            for (int j = 0; j < n; j++) {
+                float w = max(p[j].w, EPS);
+                float x = p[j].x / w, y = p[j].y / w;
+                rect.x0 = min(rect.x0, x);
+                rect.y0 = min(rect.y0, y);
+                rect.x1 = max(rect.x1, x);
+                rect.y1 = max(rect.y1, y);
+                count++;
+            }
+        }
+        if (!count) return false;
+
+        rect.x0 = max(rect.x0 - PORTALS_RECT_EPS, view.x0);
+        rect.y0 = max(rect.y0 - PORTALS_RECT_EPS, view.y0);
+        rect.x1 = min(rect.x1 + PORTALS_RECT_EPS, view.x1);
+        rect.y1 = min(rect.y1 + PORTALS_RECT_EPS, view.y1);
+        return !rect.isEmpty();
+    }
+
+    void traverse(int roomIndex, const mat4 &viewProj, const vec3 &viewPos) {
+        const TR::Level &level = *this->level;
+        for (int i = 0; i < level.roomsCount; i++) {
+            rects[i].x0 = rects[i].x1 = 0.0f;
+            visits[i] = 0;
+            queued[i] = false;
+        }
+
+        Rect full = { -1.0f, -1.0f, 1.0f, 1.0f };
+        rects[roomIndex] = full;
+        visible[0] = queue[0] = roomIndex;
+        queued[roomIndex] = true;
+        visibleCount = 1;
+        roomsVisited = portalsClipped = 0;
+
+        int head = 0, count = 1;
+        while (count) {
+            int index = queue[head];
+            head = (head + 1) % level.roomsCount;
+            count--;
+            queued[index] = false;
+            visits[index]++;
+            roomsVisited++;
+
+            const TR::Room &room = level.rooms[index];
+            vec3 offset = vec3(room.info.x, 0.0f, room.info.z);
+
+            for (int i = 0; i < room.portalsCount; i++) {
+                const TR::Room::Portal &p = room.portals[i];
+
+                vec3 v[] = {
+                    offset + p.vertices[0],
+                    offset + p.vertices[1],
+                    offset + p.vertices[2],
+                    offset + p.vertices[3],
+                };
+
+                if (vec3(p.normal).dot(viewPos - v[0]) < 0.0f) // check portal winding order
+                    continue;
+
+                int next = p.roomIndex;
+                if (!isPossiblyVisible(roomIndex, next))
+                    continue;
+
+                Rect rect;
+                portalsClipped++;
+                if (!getRect(v, 4, viewProj, rects[index], rect))
+                    continue;
+
+                if (!visits[next] && !queued[next])
+                    visible[visibleCount++] = next;
+
+                if (!rects[next].merge(rect) || queued[next])
+                    continue;
+
+                if (visits[next] + 1 >= PORTALS_MAX_VISITS)
+                    rects[next] = full;
+
+                queue[(head + count++) % level.roomsCount] = next;
+                queued[next] = true;
+            }
+        }
+    }
+
+// screen rect of the room in pixels (x, y, width & height)
+    void getScissor(int roomIndex, int width, int height, short4 &scissor) const {
+        const Rect &r = rects[roomIndex];
+        int x0 = clamp(int(floorf((r.x0 * 0.5f + 0.5f) * width)),  0, width);
+        int y0 = clamp(int(floorf((r.y0 * 0.5f + 0.5f) * height)), 0, height);
+        int x1 = clamp(int(ceilf((r.x1 * 0.5f + 0.5f) * width)),   0, width);
+        int y1 = clamp(int(ceilf((r.y1 * 0.5f + 0.5f) * height)),  0, height);
+        scissor.x = x0;
+        scissor.y = y0;
+        scissor.z = x1 - x0;
+        scissor.w = y1 - y0;
+    }
+
+// frustum of the room visible through its portals
+    void getFrustum(int roomIndex, const mat4 &viewProj, const vec3 &viewPos, Frustum &frustum) const {
+        const Rect &r = rects[roomIndex];
+        frustum.pos = viewPos;
+        frustum.calcPlanes(viewProj, r.x0, r.y0, r.x1, r.y1);
+    }
+};
+
+#endif
@@ -4,8 +4,14 @@ varying vec3 vLightVec[MAX_LIGHTS];
 varying vec3 vViewVec;
 varying vec2 vTexCoord;
 varying vec4 vColor;
+#ifdef INSTANCED
+varying vec4 vInstLightColor;
+varying vec2 vInstParam; // x - alpha, y - ambient
+#endif
 
 #ifdef VERTEX
+    invariant gl_Position; // the same depth in pre-pass & color pass
+
     uniform mat4 uViewProj;
     uniform mat4 uModel;
     uniform mat4 uViewInv;
@@ -17,6 +23,10 @@ varying vec4 vColor;
         uniform vec2 uAnimTexOffsets[MAX_OFFSETS];
     #endif
 
+    #ifdef SKINNED
+        uniform mat4 uJoints[MAX_JOINTS]; // model matrix by joint index in coord.w
+    #endif
+
     uniform vec4 uParam; // x - time
     
     attribute vec4 aCoord;
@@ -24,11 +34,58 @@ varying vec4 vColor;
     attribute vec4 aNormal;
     attribute vec4 aColor;
 
+    #ifdef INSTANCED // per instance model matrix & shading (instead of uModel, uColor, uAmbient and light 0)
+        attribute vec4 aModel0;
+        attribute vec4 aModel1;
+        attribute vec4 aModel2;
+        attribute vec4 aModel3;
+        attribute vec4 aInstColor;
+        attribute vec4 aInstLightPos;   // xyz - position, w - ambient
+        attribute vec4 aInstLightColor;
+    #endif
+
     #define TEXCOORD_SCALE (1.0 / 32767.0)
+
+    #ifdef COMPACT
+        vec3 decodeNormal(vec2 e) { // octahedral
+            e *= 1.0 / 32767.0;
+            vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+            if (n.z < 0.0)
+                n.xy = (1.0 - abs(n.yx)) * (step(0.0, n.xy) * 2.0 - 1.0);
+            return normalize(n);
+        }
+    #endif
     
     void main() {
-        vec4 coord  = uModel * vec4(aCoord.xyz, 1.0);
-        vColor      = aColor;
+        #ifdef COMPACT // anim tex range & frame in coord.w, sprite corner offset in normal
+            #ifdef SPRITE
+                vec4 texCoord = vec4(aTexCoord.xy, aNormal.xy);
+            #elif defined(SKINNED) // skinned models have no animated textures in compact format
+                vec4 texCoord = vec4(aTexCoord.xy, 0.0, 0.0);
+                vec4 normal   = vec4(decodeNormal(aNormal.xy), 0.0);
+            #else
+                vec4 texCoord = vec4(aTexCoord.xy, floor(aCoord.w / 256.0), mod(aCoord.w, 256.0));
+                vec4 normal   = vec4(decodeNormal(aNormal.xy), 0.0);
+            #endif
+        #else
+            vec4 texCoord = aTexCoord;
+            vec4 normal   = aNormal;
+        #endif
+
+        #ifdef INSTANCED
+            mat4 model  = mat4(aModel0, aModel1, aModel2, aModel3);
+            vColor      = vec4(aColor.xyz * aInstColor.xyz, aColor.w);
+            vInstLightColor = aInstLightColor;
+            vInstParam  = vec2(aInstColor.w, aInstLightPos.w);
+        #elif defined(SKINNED)
+            mat4 model  = uJoints[int(aCoord.w)];
+            vColor      = aColor;
+        #else
+            mat4 model  = uModel;
+            vColor      = aColor;
+        #endif
+
+        vec4 coord  = model * vec4(aCoord.xyz, 1.0);
         
         #ifdef CAUSTICS
             float sum = coord.x + coord.y + coord.z;
@@ -37,37 +94,58 @@ varying vec4 vColor;
 
         #ifndef SPRITE
             // animated texture coordinates
-            vec2 range  = uAnimTexRanges[int(aTexCoord.z)]; // x - start index, y - count
+            vec2 range  = uAnimTexRanges[int(texCoord.z)]; // x - start index, y - count
 
-            float f = fract((aTexCoord.w + uParam.x * 4.0 - range.x) / range.y) * range.y;
+            float f = fract((texCoord.w + uParam.x * 4.0 - range.x) / range.y) * range.y;
             vec2 offset = uAnimTexOffsets[int(range.x + f)]; // texCoord offset from first frame
 
-            vTexCoord   = (aTexCoord.xy + offset) * TEXCOORD_SCALE; // first frame + offset * isAnimated
-            vNormal     = uModel * aNormal;
+            vTexCoord   = (texCoord.xy + offset) * TEXCOORD_SCALE; // first frame + offset * isAnimated
+            vNormal     = model * normal;
         #else
-            vTexCoord   = aTexCoord.xy * TEXCOORD_SCALE;
-            coord.xyz   -= uViewInv[0].xyz * aTexCoord.z + uViewInv[1].xyz * aTexCoord.w;
+            vTexCoord   = texCoord.xy * TEXCOORD_SCALE;
+            coord.xyz   -= uViewInv[0].xyz * texCoord.z + uViewInv[1].xyz * texCoord.w;
             vNormal     = vec4(uViewPos.xyz - coord.xyz, 0.0);
         #endif
 
         vViewVec = uViewPos - coord.xyz;
         for (int i = 0; i < MAX_LIGHTS; i++)
             vLightVec[i] = uLightPos[i] - coord.xyz;
+        #ifdef INSTANCED
+            vLightVec[0] = aInstLightPos.xyz - coord.xyz;
+        #endif
 
         gl_Position = uViewProj * coord;
     }
 #else
     uniform sampler2D   sDiffuse;
+    #ifdef PALETTE
+        uniform sampler2D sPalette; // 256x1 RGBA, sDiffuse holds 8-bit indices
+    #endif
     uniform vec4        uColor;
     uniform vec3        uAmbient;
     uniform vec4        uLightColor[MAX_LIGHTS];
 
     void main() {
-        vec4 color = texture2D(sDiffuse, vTexCoord);
-        if (color.w < 0.6)
-            discard;
+        #ifdef DEPTH // pre-pass of opaque faces, color writes are masked
+            gl_FragColor = vec4(0.0);
+            return;
+        #endif
 
-        color *= uColor;
+        #ifdef PALETTE
+            vec4 color = texture2D(sPalette, vec2(texture2D(sDiffuse, vTexCoord).r * (255.0 / 256.0) + (0.5 / 256.0), 0.5));
+        #else
+            vec4 color = texture2D(sDiffuse, vTexCoord);
+        #endif
+        #ifndef OPAQUE // faces without transparent texels skip alpha test
+            if (color.w < 0.6)
+                discard;
+        #endif
+
+        #ifdef INSTANCED
+            color.w   *= vInstParam.x; // instance color.xyz is in vColor
+        #else
+            color *= uColor;
+        #endif
         color.xyz *= vColor.xyz;
 
         color.xyz = pow(abs(color.xyz), vec3(2.2)); // to linear space
@@ -75,10 +153,17 @@ varying vec4 vColor;
     // calc point lights
         vec3 normal   = normalize(vNormal.xyz);
         vec3 viewVec  = normalize(vViewVec);
-        vec3 light    = uAmbient;
+        #ifdef INSTANCED
+            vec3 light = vec3(vInstParam.y);
+        #else
+            vec3 light = uAmbient;
+        #endif
         for (int i = 0; i < MAX_LIGHTS; i++) {
             vec3 lv = vLightVec[i];
             vec4 lc = uLightColor[i];
+            #ifdef INSTANCED
+                if (i == 0) lc = vInstLightColor;
+            #endif
             float lum = max(0.0, dot(normal, normalize(lv)));
             float att = max(0.0, 1.0 - dot(lv, lv) / lc.w);
             light += lc.xyz * (lum * att);
@@ -3,18 +3,23 @@
 
 #include "core.h"
 
-enum AttribType     { aCoord, aTexCoord, aNormal, aColor, aMAX };
-enum SamplerType    { sDiffuse, sMAX };
-enum UniformType    { uViewProj, uViewInv, uModel, uParam, uColor, uAmbient, uViewPos, uLightPos, uLightColor, uAnimTexRanges, uAnimTexOffsets, uMAX };
+enum AttribType     { aCoord, aTexCoord, aNormal, aColor, aModel0, aModel1, aModel2, aModel3, aInstColor, aInstLightPos, aInstLightColor, aMAX };
+enum SamplerType    { sDiffuse, sPalette, sMAX };
+enum UniformType    { uViewProj, uViewInv, uModel, uParam, uColor, uAmbient, uViewPos, uLightPos, uLightColor, uAnimTexRanges, uAnimTexOffsets, uJoints, uMAX };
 
-const char *AttribName[aMAX]    = { "aCoord", "aTexCoord", "aNormal", "aColor" };
-const char *SamplerName[sMAX]   = { "sDiffuse" };
-const char *UniformName[uMAX]   = { "uViewProj", "uViewInv", "uModel", "uParam", "uColor", "uAmbient", "uViewPos", "uLightPos", "uLightColor", "uAnimTexRanges", "uAnimTexOffsets" };
+const char *AttribName[aMAX]    = { "aCoord", "aTexCoord", "aNormal", "aColor", "aModel0", "aModel1", "aModel2", "aModel3", "aInstColor", "aInstLightPos", "aInstLightColor" };
+const char *SamplerName[sMAX]   = { "sDiffuse", "sPalette" };
+const char *UniformName[uMAX]   = { "uViewProj", "uViewInv", "uModel", "uParam", "uColor", "uAmbient", "uViewPos", "uLightPos", "uLightColor", "uAnimTexRanges", "uAnimTexOffsets", "uJoints" };
 
 struct Shader {
     GLuint  ID;
     GLint   uID[uMAX];
 
+    struct {
+        char    *data;
+        int     size;
+    } uValue[uMAX]; // shadow copies of uploaded uniform values
+
     Shader(const char *text, const char *defines = "") {
         #ifdef MOBILE
 	        #define GLSL_DEFINE "precision highp float;\n" "#define MOBILE\n"
@@ -55,38 +60,67 @@ struct Shader {
         for (int st = 0; st < sMAX; st++)
             glUniform1iv(glGetUniformLocation(ID, (GLchar*)SamplerName[st]), 1, &st);
 
-        for (int ut = 0; ut < uMAX; ut++)
+        for (int ut = 0; ut < uMAX; ut++) {
             uID[ut] = glGetUniformLocation(ID, (GLchar*)UniformName[ut]);
+            uValue[ut].data = NULL;
+            uValue[ut].size = 0;
+        }
     }
 
     virtual ~Shader() {
+        if (Core::active.shader == this)
+            Core::active.shader = NULL;
+        for (int ut = 0; ut < uMAX; ut++)
+            delete[] uValue[ut].data;
         glDeleteProgram(ID);
     }
 
     void bind() {
-        if (Core::active.shader != this) {
-            Core::active.shader = this;
+        if (Core::setState(Core::active.shader, this))
             glUseProgram(ID);
+    }
+
+// returns true if uniform value differs from the uploaded one (and updates shadow copy)
+    bool changed(UniformType uType, const void *value, int size) {
+        if (uID[uType] == -1)
+            return false;
+
+        char *&data = uValue[uType].data;
+        int  &count = uValue[uType].size;
+        if (size <= count && !memcmp(data, value, size)) {
+            Core::stats.uniforms[1]++;
+            return false;
+        }
+
+        if (size > count) { // elements above size are kept, they are still uploaded
+            char *ptr = new char[size];
+            if (data) memcpy(ptr, data, count);
+            delete[] data;
+            data  = ptr;
+            count = size;
         }
+        memcpy(data, value, size);
+        Core::stats.uniforms[0]++;
+        return true;
     }
 
     void setParam(UniformType uType, const vec2 &value, int count = 1) {
-        if (uID[uType] != -1)
+        if (changed(uType, &value, count * sizeof(value)))
             glUniform2fv(uID[uType], count, (GLfloat*)&value);
     }
 
     void setParam(UniformType uType, const vec3 &value, int count = 1) {
-        if (uID[uType] != -1)
+        if (changed(uType, &value, count * sizeof(value)))
             glUniform3fv(uID[uType], count, (GLfloat*)&value);
     }
 
     void setParam(UniformType uType, const vec4 &value, int count = 1) {
-        if (uID[uType] != -1)
+        if (changed(uType, &value, count * sizeof(value)))
             glUniform4fv(uID[uType], count, (GLfloat*)&value);
     }
 
     void setParam(UniformType uType, const mat4 &value, int count = 1) {
-        if (uID[uType] != -1)
+        if (changed(uType, &value, count * sizeof(value)))
             glUniformMatrix4fv(uID[uType], count, false, (GLfloat*)&value);
     }
 };
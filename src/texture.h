@@ -3,26 +3,66 @@
 
 #include "core.h"
 
+enum TexFormat { tfRGBA, tfDXT1, tfR8 };
+
+// single channel format, GLES2/WebGL1 has no GL_R8 & GL_RED (luminance is sampled as .rrr)
+#ifdef MOBILE
+    #define TEX_R8_INTERNAL GL_LUMINANCE
+    #define TEX_R8_FORMAT   GL_LUMINANCE
+#else
+    #define TEX_R8_INTERNAL GL_R8
+    #define TEX_R8_FORMAT   GL_RED
+#endif
+
 struct Texture {
     GLuint  ID;
-    int     width, height;
+    int     width, height, format;
 
-    Texture(int width, int height, int format, void *data) : width(width), height(height) {
+// data contains all mip levels one after another (or NULL to allocate storage only, uncompressed formats)
+    Texture(int width, int height, int format, void *data, int mips = 1, bool filter = true) : width(width), height(height), format(format) {
         glGenTextures(1, &ID);
         bind(0);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter ? GL_LINEAR : GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter ? (mips > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR) : (mips > 1 ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST));
+    #ifdef MOBILE
+        ASSERT(mips == 1); // no GL_TEXTURE_MAX_LEVEL, partial mip chains are incomplete
+    #else
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mips - 1);
+    #endif
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        for (int i = 0; i < mips; i++) {
+            int w = max(1, width >> i), h = max(1, height >> i);
+            if (format == tfDXT1) {
+                int size = ((w + 3) / 4) * ((h + 3) / 4) * 8;
+                glCompressedTexImage2D(GL_TEXTURE_2D, i, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, w, h, 0, size, data);
+                data = (char*)data + size;
+            } else if (format == tfR8) {
+                glTexImage2D(GL_TEXTURE_2D, i, TEX_R8_INTERNAL, w, h, 0, TEX_R8_FORMAT, GL_UNSIGNED_BYTE, data);
+                if (data) data = (char*)data + w * h;
+            } else {
+                glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+                if (data) data = (char*)data + w * h * 4;
+            }
+        }
+    }
+
+    void update(int x, int y, int width, int height, void *data, int level = 0) {
+        bind(0);
+        Core::setTextureUnit(0);
+        glTexSubImage2D(GL_TEXTURE_2D, level, x, y, width, height, format == tfR8 ? TEX_R8_FORMAT : GL_RGBA, GL_UNSIGNED_BYTE, data);
     }
 
     virtual ~Texture() {
+        for (int i = 0; i < int(sizeof(Core::active.textures) / sizeof(Core::active.textures[0])); i++)
+            if (Core::active.textures[i] == this)
+                Core::active.textures[i] = NULL;
         glDeleteTextures(1, &ID);
     }
 
     void bind(int sampler) {
-        glActiveTexture(GL_TEXTURE0 + sampler);
+        if (!Core::setState(Core::active.textures[sampler], this)) return;
+        Core::setTextureUnit(sampler);
         glBindTexture(GL_TEXTURE_2D, ID);
     }
 };
@@ -0,0 +1,329 @@
+#ifndef H_THREAD
+#define H_THREAD
+
+#include "utils.h"
+
+#if defined(__EMSCRIPTEN__)
+    #include <emscripten.h>
+    #define NO_THREADS  // worker procs are executed synchronously
+#elif defined(WIN32)
+    #include <windows.h>
+#elif defined(__linux__) || defined(__APPLE__)
+    #include <pthread.h>
+    #include <sched.h>
+    #include <unistd.h>
+    #include <sys/time.h>
+#endif
+
+#define MAX_WORKERS 32
+
+namespace Thread {
+    typedef void (Proc)(void *arg);
+
+    struct Worker {
+        Proc    *proc;
+        void    *arg;
+    #if defined(NO_THREADS)
+    #elif defined(WIN32)
+        HANDLE  handle;
+    #else
+        pthread_t handle;
+    #endif
+    };
+
+#if defined(NO_THREADS)
+#elif defined(WIN32)
+    DWORD WINAPI workerProc(void *arg) {
+        Worker *w = (Worker*)arg;
+        w->proc(w->arg);
+        return 0;
+    }
+#else
+    void* workerProc(void *arg) {
+        Worker *w = (Worker*)arg;
+        w->proc(w->arg);
+        return NULL;
+    }
+#endif
+
+// run proc(arg) in a new thread, returned worker must be released by join
+    Worker* create(Proc *proc, void *arg) {
+        Worker *w = new Worker();
+        w->proc = proc;
+        w->arg  = arg;
+    #if defined(NO_THREADS)
+        proc(arg);
+    #elif defined(WIN32)
+        w->handle = CreateThread(NULL, 0, workerProc, w, 0, NULL);
+    #else
+        pthread_create(&w->handle, NULL, workerProc, w);
+    #endif
+        return w;
+    }
+
+    void join(Worker *w) {
+        if (!w) return;
+    #if defined(NO_THREADS)
+    #elif defined(WIN32)
+        WaitForSingleObject(w->handle, INFINITE);
+        CloseHandle(w->handle);
+    #else
+        pthread_join(w->handle, NULL);
+    #endif
+        delete w;
+    }
+
+// returns previous value
+    int atomicAdd(volatile int &value, int x) {
+    #if defined(NO_THREADS)
+        int v = value;
+        value += x;
+        return v;
+    #elif defined(WIN32)
+        return InterlockedExchangeAdd((volatile LONG*)&value, x);
+    #else
+        return __sync_fetch_and_add(&value, x);
+    #endif
+    }
+
+    int atomicGet(volatile int &value) {
+        return atomicAdd(value, 0);
+    }
+
+    int getCPUCount() {
+    #if defined(NO_THREADS)
+        return 1;
+    #elif defined(WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwNumberOfProcessors;
+    #else
+        return max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    #endif
+    }
+
+    void yield() {
+    #if defined(NO_THREADS)
+    #elif defined(WIN32)
+        SwitchToThread();
+    #else
+        sched_yield();
+    #endif
+    }
+
+#ifndef NO_THREADS
+    struct Mutex {
+    #if defined(WIN32)
+        CRITICAL_SECTION cs;
+
+        Mutex()       { InitializeCriticalSection(&cs); }
+        ~Mutex()      { DeleteCriticalSection(&cs); }
+        void lock()   { EnterCriticalSection(&cs); }
+        void unlock() { LeaveCriticalSection(&cs); }
+    #else
+        pthread_mutex_t mutex;
+
+        Mutex()       { pthread_mutex_init(&mutex, NULL); }
+        ~Mutex()      { pthread_mutex_destroy(&mutex); }
+        void lock()   { pthread_mutex_lock(&mutex); }
+        void unlock() { pthread_mutex_unlock(&mutex); }
+    #endif
+    };
+
+// counting semaphore, wait blocks until the counter is positive and decrements it
+    struct Semaphore {
+    #if defined(WIN32)
+        HANDLE handle;
+
+        Semaphore()  { handle = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL); }
+        ~Semaphore() { CloseHandle(handle); }
+
+        void post(int count) { ReleaseSemaphore(handle, count, NULL); }
+        void wait()          { WaitForSingleObject(handle, INFINITE); }
+    #else // no unnamed sem_t on OSX
+        pthread_mutex_t mutex;
+        pthread_cond_t  cond;
+        int             value;
+
+        Semaphore() : value(0) {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+        }
+
+        ~Semaphore() {
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        void post(int count) {
+            pthread_mutex_lock(&mutex);
+            value += count;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        void wait() {
+            pthread_mutex_lock(&mutex);
+            while (!value)
+                pthread_cond_wait(&cond, &mutex);
+            value--;
+            pthread_mutex_unlock(&mutex);
+        }
+    #endif
+    };
+#endif
+
+// parallel for, indices are distributed between pool workers and the calling thread via atomic counter
+    typedef void (ForProc)(void *arg, int index);
+
+    struct ForJob {
+        ForProc         *proc;
+        void            *arg;
+        int             count;
+        volatile int    index;
+        volatile int    pending;    // queued or running pool entries
+    };
+
+    void forProc(void *arg) {
+        ForJob *job = (ForJob*)arg;
+        int i;
+        while ((i = atomicAdd(job->index, 1)) < job->count)
+            job->proc(job->arg, i);
+    }
+
+#ifndef NO_THREADS
+    #define POOL_QUEUE_SIZE (MAX_WORKERS * 2)
+
+// persistent workers, created by the first parallelFor call and released by Thread::free
+// each queue entry is one helper for the job, several callers (loader & render threads) may share the pool
+    struct Pool {
+        Worker      *workers[MAX_WORKERS];
+        int         count;
+        ForJob      *queue[POOL_QUEUE_SIZE];
+        int         queueCount;
+        bool        quit;
+        Mutex       mutex;
+        Semaphore   signal;
+    } *pool;
+
+    volatile int poolInit, poolReady;
+
+    void poolProc(void *arg) {
+        Pool *p = (Pool*)arg;
+        while (1) {
+            p->signal.wait();
+
+            p->mutex.lock();
+            ForJob *job = NULL;
+            if (p->queueCount) {
+                job = p->queue[0];
+                p->queueCount--;
+                for (int i = 0; i < p->queueCount; i++)
+                    p->queue[i] = p->queue[i + 1];
+            }
+            bool quit = p->quit;
+            p->mutex.unlock();
+
+            if (job) {
+                forProc(job);
+                atomicAdd(job->pending, -1);
+            } else if (quit)
+                break; // else the entry was taken back by its caller
+        }
+    }
+
+    Pool* getPool() {
+        if (atomicGet(poolReady))
+            return pool;
+
+        if (atomicAdd(poolInit, 1) == 0) {
+            pool = new Pool();
+            pool->count      = min(getCPUCount(), MAX_WORKERS) - 1;
+            pool->queueCount = 0;
+            pool->quit       = false;
+            for (int i = 0; i < pool->count; i++)
+                pool->workers[i] = create(poolProc, pool);
+            atomicAdd(poolReady, 1);
+        } else
+            while (!atomicGet(poolReady))
+                yield();
+
+        return pool;
+    }
+#endif
+
+    void free() {
+    #ifndef NO_THREADS
+        if (!atomicGet(poolReady))
+            return;
+        pool->mutex.lock();
+        pool->quit = true;
+        pool->mutex.unlock();
+        pool->signal.post(pool->count);
+        for (int i = 0; i < pool->count; i++)
+            join(pool->workers[i]);
+        delete pool;
+        pool      = NULL;
+        poolInit  = 0;
+        poolReady = 0;
+    #endif
+    }
+
+    void parallelFor(int count, ForProc *proc, void *arg, int threads = 0) {
+        ForJob job = { proc, arg, count, 0, 0 };
+        if (threads <= 0)
+            threads = getCPUCount();
+        threads = min(min(threads, count), MAX_WORKERS);
+
+    #ifndef NO_THREADS
+        Pool *p = threads > 1 ? getPool() : NULL;
+        if (p) {
+            p->mutex.lock();
+            int helpers = min(min(threads - 1, p->count), POOL_QUEUE_SIZE - p->queueCount);
+            for (int i = 0; i < helpers; i++)
+                p->queue[p->queueCount++] = &job;
+            job.pending = helpers;
+            p->mutex.unlock();
+            if (helpers)
+                p->signal.post(helpers);
+        }
+    #endif
+
+        forProc(&job);
+
+    #ifndef NO_THREADS
+        if (p && atomicGet(job.pending)) {
+        // take back the entries not started by busy workers and wait for the running ones
+            p->mutex.lock();
+            int j = 0;
+            for (int i = 0; i < p->queueCount; i++)
+                if (p->queue[i] != &job)
+                    p->queue[j++] = p->queue[i];
+            atomicAdd(job.pending, j - p->queueCount);
+            p->queueCount = j;
+            p->mutex.unlock();
+
+            while (atomicGet(job.pending))
+                yield();
+        }
+    #endif
+    }
+
+// monotonic time in milliseconds
+    double getTime() {
+    #if defined(__EMSCRIPTEN__)
+        return emscripten_get_now();
+    #elif defined(WIN32)
+        LARGE_INTEGER freq, count;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&count);
+        return count.QuadPart * 1000.0 / freq.QuadPart;
+    #else
+        timeval t;
+        gettimeofday(&t, NULL);
+        return t.tv_sec * 1000.0 + t.tv_usec * 0.001;
+    #endif
+    }
+}
+
+#endif
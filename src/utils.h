@@ -6,6 +6,13 @@
 #include <math.h>
 #include <float.h>
 
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define SIMD_SSE2
+#endif
+
 #ifdef _DEBUG
     #define debugBreak() _asm { int 3 }
     #define ASSERT(expr) if (expr) {} else { LOG("ASSERT %s in %s:%d\n", #expr, __FILE__, __LINE__); debugBreak(); }
@@ -34,12 +41,19 @@
 #define RAD2DEG (180.0f / PI)
 #define randf() ((float)rand()/RAND_MAX)
 
+#ifdef _MSC_VER
+    #define ALIGNOF(T)  __alignof(T)
+#else
+    #define ALIGNOF(T)  alignof(T)
+#endif
+
 typedef char            int8;
 typedef short           int16;
 typedef int             int32;
 typedef unsigned char   uint8;
 typedef unsigned short  uint16;
 typedef unsigned int    uint32;
+typedef unsigned long long uint64;
 
 #define FOURCC(str)     (*((uint32*)str))
 
@@ -79,6 +93,13 @@ inline const int sign(const T &x) {
     return x > 0 ? 1 : (x < 0 ? -1 : 0);
 }
 
+template <class T>
+inline void swap(T &a, T &b) {
+    T t = a;
+    a = b;
+    b = t;
+}
+
 float clampAngle(float a) {
     return a < -PI ? a + PI2 : (a >= PI ? a - PI2 : a);
 }
@@ -565,50 +586,183 @@ struct Box {
     }
 };
 
+// FNV-1a by 32-bit words, tail is zero-padded
+uint32 fnv32(const void *data, int size, uint32 hash = 0x811C9DC5) {
+    const uint32 *ptr = (uint32*)data;
+    for (int i = 0; i < size / 4; i++)
+        hash = (hash ^ ptr[i]) * 0x01000193;
+    if (size % 4) {
+        uint32 tail = 0;
+        memcpy(&tail, &ptr[size / 4], size % 4);
+        hash = (hash ^ tail) * 0x01000193;
+    }
+    return hash;
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+// private (copy-on-write) read & write mapping of the whole file
+void* mapFile(const char *name, int &size) {
+    void *data = NULL;
+    size = 0;
+#if defined(__linux__) || defined(__APPLE__)
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        else
+            size = (int)st.st_size;
+    }
+    close(fd);
+#elif defined(WIN32)
+    HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    HANDLE fmap = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (fmap) {
+        data = MapViewOfFile(fmap, FILE_MAP_COPY, 0, 0, 0);
+        if (data) size = (int)GetFileSize(file, NULL);
+        CloseHandle(fmap);
+    }
+    CloseHandle(file);
+#else // no mapping support, read whole file into memory
+    FILE *f = fopen(name, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size);
+    fread(data, 1, size, f);
+    fclose(f);
+#endif
+    return data;
+}
+
+void unmapFile(void *data, int size) {
+    if (!data) return;
+#if defined(__linux__) || defined(__APPLE__)
+    munmap(data, size);
+#elif defined(WIN32)
+    UnmapViewOfFile(data);
+#else
+    free(data);
+#endif
+}
+
+#ifndef STREAM_BUFFER_SIZE
+    #define STREAM_BUFFER_SIZE (64 * 1024)  // read-ahead buffer size for file streams
+#endif
+
 struct Stream {
     FILE        *f;
     const char	*data;
     int         size, pos;
+    void        *mapping;   // file mapping (owned by stream until detach), aligned arrays are not copied but point into it
+
+    char        *buffer;    // read-ahead buffer of file stream
+    int         bufferSize, bufferPos, bufferCount; // capacity, file offset and size of buffered data
+    int         filePos;    // current file offset (to skip redundant fseek)
 
-    Stream(const void *data, int size) : f(NULL), data((char*)data), size(size), pos(0) {}
+    Stream(const void *data, int size) : f(NULL), data((char*)data), size(size), pos(0), mapping(NULL), buffer(NULL), bufferSize(0), bufferPos(0), bufferCount(0), filePos(0) {}
 
-    Stream(const char *name) : data(NULL), size(-1), pos(0) {
+    Stream(const char *name, bool map = false, int bufferSize = STREAM_BUFFER_SIZE) : f(NULL), data(NULL), size(-1), pos(0), mapping(NULL), buffer(NULL), bufferSize(bufferSize), bufferPos(0), bufferCount(0), filePos(0) {
     #ifdef __APPLE__
         extern char *contentPath;
         int len = strlen(contentPath);
         strcat(contentPath, name);
-        f = fopen(contentPath, "rb");
+        if (map) mapping = mapFile(contentPath, size);
+        if (!mapping) f = fopen(contentPath, "rb");
         contentPath[len] = '\0';
     #else
-        f = fopen(name, "rb");
+        if (map) mapping = mapFile(name, size);
+        if (!mapping) f = fopen(name, "rb");
     #endif
-        if (!f) LOG("error loading file\n");
+        if (mapping) {
+            data = (char*)mapping;
+            return;
+        }
+        if (!f) {
+            LOG("error loading file\n");
+            size = 0;
+            return;
+        }
+        setvbuf(f, NULL, _IONBF, 0); // we do our own buffering
         fseek(f, 0, SEEK_END);
         size = ftell(f);
         fseek(f, 0, SEEK_SET);
+        if (this->bufferSize > 0)
+            buffer = new char[this->bufferSize];
     }
 
     ~Stream() {
         if (f) fclose(f);
+        unmapFile(mapping, size);
+        delete[] buffer;
+    }
+
+    // transfer ownership of the file mapping to the caller (use unmapFile to release it)
+    void* detach() {
+        void *ptr = mapping;
+        mapping = NULL;
+        return ptr;
     }
 
     void setPos(int pos) {
         this->pos = pos;
-        if (f) fseek(f, pos, SEEK_SET);
     }
 
     void seek(int offset) {
-        if (!offset) return;
-        if (f) fseek(f, offset, SEEK_CUR);
         pos += offset;
     }
 
+    void fileRead(void *data, int count) {
+        if (filePos != pos)
+            fseek(f, pos, SEEK_SET);
+        filePos = pos + fread(data, 1, count, f);
+    }
+
     void raw(void *data, int count) {
-        if (f)
-            fread(data, 1, count, f);
-        else
-            memcpy(data, this->data + pos, count);
-        pos += count;
+        if (count <= 0) return;
+        int avail = clamp(size - pos, 0, count);
+        if (avail < count) {
+            LOG("! stream: read out of bounds\n");
+            memset((char*)data + avail, 0, count - avail);
+        }
+
+        if (!f) {
+            memcpy(data, this->data + pos, avail);
+            pos += count;
+            return;
+        }
+
+        char *ptr = (char*)data;
+        int  end  = pos + count;
+        while (avail > 0) {
+            int offset = pos - bufferPos;
+            if (offset >= 0 && offset < bufferCount) { // buffer hit
+                int n = min(avail, bufferCount - offset);
+                memcpy(ptr, buffer + offset, n);
+                ptr   += n;
+                pos   += n;
+                avail -= n;
+            } else if (avail >= bufferSize) { // large reads go directly to the destination
+                fileRead(ptr, avail);
+                break;
+            } else { // refill buffer
+                bufferPos = pos;
+                fileRead(buffer, bufferSize);
+                bufferCount = filePos - bufferPos;
+                if (!bufferCount) break;
+            }
+        }
+        pos = end;
     }
 
     template <typename T>
@@ -618,10 +772,31 @@ struct Stream {
     }
 
     template <typename T>
-    inline T* read(T *&a, int count) {
+    bool isAligned() const {
+        return ((size_t)(data + pos) & (ALIGNOF(T) - 1)) == 0;
+    }
+
+    bool isMapped(const void *ptr) const {
+        return mapping && ptr >= data && ptr < data + size;
+    }
+
+// array points into the file mapping if it is aligned for T (strict alignment CPUs), otherwise it is a copy owned by the caller
+// out of bounds count is reset to zero, so the caller never walks an empty array
+    template <typename T, typename C>
+    inline T* read(T *&a, C &count) {
+        if (int(count) < 0 || int(count) > (size - pos) / (int)sizeof(T)) {
+            LOG("! stream: array of %d items is out of bounds\n", int(count));
+            count = 0;
+        }
+
         if (count) {
-            a = new T[count];
-            raw(a, count * sizeof(T));
+            if (mapping && isAligned<T>()) { // zero-copy
+                a = (T*)(data + pos);
+                pos += count * sizeof(T);
+            } else {
+                a = new T[count];
+                raw(a, count * sizeof(T));
+            }
         } else
             a = NULL;
         return a;